@@ -0,0 +1,5959 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <regex.h>
+#define HAVE_REGEX 1
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+#ifdef __GNUC__
+#define PREFETCH(address) __builtin_prefetch((address), 1)
+#else
+#define PREFETCH(address) ((void)(address))
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_DISPATCH 1    // AVX2 and AVX-512 kernels, picked at run time
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#else
+#include <unistd.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "iot_analyzer.h"
+
+#define MAX_LINE_LENGTH 1024       // metadata table only; data rows are unbounded
+#define MAX_FIELD_LENGTH 64        // longer numeric or date fields make a row overlong
+#define NUM_FIELDS 12
+#define AGG_BATCH 16               // runs hashed and prefetched together
+#define MAX_RUN (1 << 16)          // longest run of same-group records reduced at once
+#define QUARANTINE_FLUSH (64 * 1024)
+#define MAX_DEVICES 100
+#define MAX_MONTHS 12
+#define NUM_SENSORS IOT_NUM_SENSORS
+#define FILTER_BATCH 1024
+#define MAX_FILTER_INSTRS 64
+#define MAX_FILTER_DEPTH 16
+#define DEVICE_NAME_LENGTH 50
+#define VALID_GEO IOT_VALID_GEO
+#define ALL_SENSORS ((1 << NUM_SENSORS) - 1)
+
+#define KEY_DEVICE 1
+#define KEY_TIME 2
+#define KEY_GEO 4
+#define KEY_META 8
+#define GEO_UNKNOWN 0xFFFFFFFFFFFFULL
+#define META_UNKNOWN 0xFFFF
+#define MAX_META_ATTRS 8
+#define SAMPLE_BLOCK_SIZE (256 * 1024)
+
+// Interns device names to dense ids in first-seen order. Ids stay ints:
+// group keys and segment codes hold 32 bits, so the dictionary stops
+// growing at 2^30 names.
+typedef struct {
+    char (*names)[DEVICE_NAME_LENGTH];
+    int count;
+    int capacity;
+    int *slots;
+    int slot_mask;
+} DeviceDict;
+
+// Device metadata (site, model, ...) loaded from a side table. `index` maps
+// a device name to its metadata row; the per-device arrays are filled once
+// the data has been parsed, so joining a row is a single array lookup.
+typedef struct {
+    int num_attrs;
+    char attr_names[MAX_META_ATTRS][DEVICE_NAME_LENGTH];
+    DeviceDict index;
+    char (*values)[MAX_META_ATTRS][DEVICE_NAME_LENGTH];
+    int *row_of_device;        // data device id -> metadata row, -1 if unknown
+    int key_attr;              // attribute used as a group key, -1 if none
+    DeviceDict key_values;     // interned values of key_attr
+    int *key_of_device;        // data device id -> key value id or META_UNKNOWN
+} DeviceMeta;
+
+// Group keys are packed into 128 bits so hashing and comparing never branch:
+// lo holds the device id (bits 0-31) and the time bucket ordinal (32-63),
+// hi holds the latitude and longitude tile indices (24 bits each) and the
+// metadata attribute value id (48-63).
+typedef struct {
+    unsigned long long lo;
+    unsigned long long hi;
+} GroupKey;
+
+typedef enum {
+    BUCKET_NONE,
+    BUCKET_YEAR,
+    BUCKET_MONTH,
+    BUCKET_DAY,
+    BUCKET_HOUR
+} TimeBucket;
+
+typedef struct {
+    int parts;                 // KEY_* flags
+    TimeBucket bucket;
+    double geo_cell;           // tile size in degrees
+    char meta_attr[DEVICE_NAME_LENGTH];
+    const DeviceMeta *meta;    // joined into the output when loaded
+} GroupSpec;
+
+typedef struct {
+    GroupKey key;
+    double max[NUM_SENSORS];
+    double min[NUM_SENSORS];
+    double sum[NUM_SENSORS];
+    long long count[NUM_SENSORS];
+    long long out_of_range[NUM_SENSORS];
+    long long rows;
+    long long seq_min;         // contagem range seen this month
+    long long seq_max;
+    long long seq_last;        // last contagem seen, for reorder detection
+    long long seq_received;
+    long long seq_reordered;   // only meaningful from one device-ordered pass
+} MonthlyStats;
+
+// Open-addressing index over a growable array of stats entries.
+typedef struct {
+    MonthlyStats *entries;
+    long long count;
+    long long capacity;
+    long long *slots;          // entry index, -1 when empty
+    long long slot_mask;
+} StatsTable;
+
+
+typedef struct {
+    long long id;              // -1 when the id column is missing
+    long long seq;             // contagem, -1 when missing
+    int device_id;
+    int date;                  // YYYYMMDD, 0 when missing or malformed
+    int time;                  // seconds since midnight
+    int block;                 // sampled runs: which of the sampled blocks the row came from
+    double values[NUM_SENSORS];
+    double latitude;
+    double longitude;
+    unsigned char valid;       // bit i set when values[i] was present, VALID_GEO for coordinates
+} SensorRecord;
+
+// The records of a sampled run, for estimates that treat each sampled
+// block as one unit.
+typedef struct {
+    const SensorRecord *records;
+    long long count;
+    long long num_blocks;      // blocks read
+    double block_fraction;     // of all blocks in the input
+} BlockSample;
+
+// Ids seen so far, shared by all workers: one bit per id in [base, base +
+// nbits) when the range is dense, otherwise an open-addressing hash of the
+// ids themselves.
+typedef struct {
+    long long base;
+    long long nbits;
+    _Atomic unsigned long long *words;
+    _Atomic long long *slots;  // -1 when empty
+    long long slot_mask;
+} IdSet;
+
+// A copy of a worker's table taken after `covered` of its records.
+typedef struct {
+    StatsTable table;
+    long long covered;
+} Snapshot;
+
+typedef struct {
+    atomic_uint request;       // bumped by the main thread to ask for snapshots
+    long long every_rows;      // also publish after this many rows, 0 = never
+} ProgressControl;
+
+typedef struct {
+    SensorRecord *records;
+    long long start;
+    long long end;
+    const GroupSpec *spec;
+    StatsTable table;          // private to the thread, merged after join
+    IdSet *seen_ids;
+    long long duplicates;
+    int failed;
+    ProgressControl *progress; // NULL unless partial results were asked for
+    _Atomic(Snapshot *) published; // latest snapshot, taken by the main thread
+    atomic_int done;
+    _Atomic long long processed; // records handled so far, for status reports
+} ThreadData;
+
+typedef enum {
+    PHASE_STARTING,
+    PHASE_COUNTING,
+    PHASE_PARSING,
+    PHASE_SORTING,
+    PHASE_AGGREGATING
+} RunPhase;
+
+static const char *phase_names[] = {"starting", "counting", "parsing", "sorting", "aggregating"};
+
+// What the status reporter reads. Every counter has a single writer that
+// updates it with relaxed stores now and then, so reporting costs the
+// writers nothing.
+typedef struct {
+    atomic_int phase;
+    _Atomic long long bytes_read;
+    _Atomic long long bytes_total;
+    _Atomic long long rows_parsed;
+    ThreadData *workers;
+    atomic_int num_workers;    // published once the workers are running
+    long long records_total;
+    int every_seconds;         // also report periodically, 0 = only on request
+    atomic_int stop;
+    int running;               // the reporter thread was started
+} RunStatus;
+
+static RunStatus run_status;
+static atomic_int status_requested;  // set by iot_request_status
+
+// Where a line ends and where its first NUM_FIELDS fields are split.
+typedef struct {
+    const char *end;           // the newline, or the end of the input
+    const char *seps[NUM_FIELDS];
+    int num_seps;
+    int has_nul;
+} LineScan;
+
+// The hot kernels, bound once by bind_kernels to the best variant the CPU
+// supports.
+typedef struct {
+    const char *name;
+    void (*scan_line)(const char *line, const char *end, LineScan *scan);
+    int (*parse_value)(const char *token, const char *end, double *value);
+    void (*update_stats)(MonthlyStats *stats, const SensorRecord *record);
+    // Reduces `count` consecutive records of one group, then merges once.
+    void (*update_run)(MonthlyStats *stats, const SensorRecord *records, long long count);
+} KernelSet;
+
+static KernelSet kernels;
+
+typedef enum {
+    STAT_MAX,
+    STAT_AVG,
+    STAT_MIN
+} StatKind;
+
+typedef struct {
+    int k;
+    int sensor;
+    StatKind stat;
+    int ascending;
+} TopKQuery;
+
+typedef struct {
+    double key;                // statistic, negated for ascending queries
+    long long index;           // into the results array
+} TopEntry;
+
+// Bounded min-heap: the root is the weakest of the entries kept so far.
+typedef struct {
+    TopEntry *entries;
+    int size;
+    int capacity;              // k, or fewer when the bucket has fewer groups
+} TopHeap;
+
+typedef struct {
+    const MonthlyStats *results;
+    long long start;
+    long long end;
+    const TopKQuery *query;
+    const int *buckets;        // the distinct time buckets, ascending
+    long long num_buckets;
+    TopHeap *heaps;            // one per entry of buckets
+} TopKThreadData;
+
+typedef enum {
+    FILTER_DATE,
+    FILTER_SENSOR,
+    FILTER_DEVICE_EQ,
+    FILTER_DEVICE_PREFIX,
+    FILTER_DEVICE_REGEX,
+    FILTER_AND,
+    FILTER_OR,
+    FILTER_NOT
+} FilterOpcode;
+
+typedef enum {
+    CMP_LT,
+    CMP_LE,
+    CMP_GT,
+    CMP_GE,
+    CMP_EQ,
+    CMP_NE
+} CompareOp;
+
+typedef struct {
+    FilterOpcode opcode;
+    CompareOp cmp;
+    int sensor;
+    int date_divisor;          // 100 compares whole months, 1 compares days
+    double value;
+    char text[DEVICE_NAME_LENGTH];
+#ifdef HAVE_REGEX
+    regex_t *regex;
+#endif
+    unsigned char *device_match;   // device predicates, evaluated once per device id
+    int device_match_count;
+} FilterInstr;
+
+// A filter expression compiled to postfix. Each instruction is evaluated
+// over a whole batch of records at once, leaving a 0/1 byte per record on a
+// small stack of vectors.
+typedef struct {
+    FilterInstr code[MAX_FILTER_INSTRS];
+    int length;
+} FilterProgram;
+
+static const char *stat_names[] = {"maximo", "medio", "minimo"};
+static const char *stat_options[] = {"max", "avg", "min"};
+
+static const char *sensor_names[NUM_SENSORS] = {
+    "temperatura",
+    "umidade",
+    "luminosidade",
+    "ruido",
+    "eco2",
+    "etvoc"
+};
+
+// Readings outside [min, max] are counted as out of range and left out of
+// the stats. Defaults cover physically impossible humidity and eco2 values.
+static double sensor_min_valid[NUM_SENSORS] = {
+    -INFINITY, 0.0, -INFINITY, -INFINITY, 400.0, -INFINITY
+};
+static double sensor_max_valid[NUM_SENSORS] = {
+    INFINITY, 100.0, INFINITY, INFINITY, 60000.0, INFINITY
+};
+
+static int get_cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    return sysinfo.dwNumberOfProcessors;
+#elif defined(__APPLE__)
+    int nm[2];
+    size_t len = 4;
+    uint32_t count;
+
+    nm[0] = CTL_HW; nm[1] = HW_AVAILCPU;
+    sysctl(nm, 2, &count, &len, NULL, 0);
+
+    if (count < 1) {
+        nm[1] = HW_NCPU;
+        sysctl(nm, 2, &count, &len, NULL, 0);
+        if (count < 1) { count = 1; }
+    }
+    return count;
+#else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+static double now_seconds() {
+#ifdef _WIN32
+    return GetTickCount64() / 1000.0;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec delay = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+#endif
+}
+
+static int id_set_init_hashed(IdSet *set, long long slots) {
+    set->slots = (_Atomic long long *)malloc((size_t)slots * sizeof(*set->slots));
+    if (!set->slots) {
+        return 0;
+    }
+    memset((void *)set->slots, -1, (size_t)slots * sizeof(*set->slots));
+    set->slot_mask = slots - 1;
+    return 1;
+}
+
+// Sized for at most `max_ids` distinct ids in [min_id, max_id]: a bitmap over
+// the range, or a hash table with twice that many slots when the range is so
+// sparse that the table is smaller. Returns 0 when out of memory.
+static int id_set_init(IdSet *set, long long min_id, long long max_id, long long max_ids) {
+    memset(set, 0, sizeof(*set));
+    set->base = min_id;
+    if (max_id < min_id || max_ids <= 0) {
+        return 1;
+    }
+
+    // Unsigned, so ids at both ends of the long long range cannot overflow.
+    unsigned long long span = (unsigned long long)max_id - (unsigned long long)min_id;
+    long long slots = 16;
+    while (slots < 2 * max_ids) {
+        slots *= 2;
+    }
+    if (span / 64 < (unsigned long long)slots) {
+        size_t nwords = (size_t)(span / 64 + 1);
+        set->words = (_Atomic unsigned long long *)calloc(nwords, sizeof(*set->words));
+        if (!set->words) {
+            return 0;
+        }
+        set->nbits = (long long)span + 1;
+        return 1;
+    }
+    return id_set_init_hashed(set, slots);
+}
+
+static inline unsigned long long id_hash(long long id) {
+    unsigned long long h = (unsigned long long)id * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+// Bit index of an id, or -1 when it lies outside the set.
+static long long id_set_bit(const IdSet *set, long long id) {
+    if (id < 0 || id < set->base) {
+        return -1;
+    }
+    unsigned long long bit = (unsigned long long)id - (unsigned long long)set->base;
+    return bit < (unsigned long long)set->nbits ? (long long)bit : -1;
+}
+
+// Pulls the word holding an id's bit (or its first hash slot) into cache
+// ahead of id_set_insert.
+static void id_set_prefetch(const IdSet *set, long long id) {
+    if (set->slots) {
+        PREFETCH(&set->slots[id_hash(id) & set->slot_mask]);
+        return;
+    }
+    long long bit = id_set_bit(set, id);
+    if (bit >= 0) {
+        PREFETCH(&set->words[bit >> 6]);
+    }
+}
+
+// Claims an empty slot with a compare-and-swap; a lost race on the slot is
+// rechecked, since the winner may have stored the same id.
+static int id_set_insert_hashed(IdSet *set, long long id) {
+    long long pos = (long long)(id_hash(id) & set->slot_mask);
+    for (;;) {
+        long long current = atomic_load_explicit(&set->slots[pos], memory_order_relaxed);
+        if (current == -1 &&
+            atomic_compare_exchange_strong_explicit(&set->slots[pos], &current, id,
+                                                    memory_order_relaxed, memory_order_relaxed)) {
+            return 1;
+        }
+        if (current == id) {
+            return 0;
+        }
+        if (current != -1) {
+            pos = (pos + 1) & set->slot_mask;
+        }
+    }
+}
+
+// Returns 1 the first time an id is seen and 0 for every repeat. Safe to call
+// from several threads at once; ids outside the set are always reported new.
+static int id_set_insert(IdSet *set, long long id) {
+    if (set->slots) {
+        return id < 0 ? 1 : id_set_insert_hashed(set, id);
+    }
+    long long bit = id_set_bit(set, id);
+    if (bit < 0) {
+        return 1;
+    }
+
+    unsigned long long mask = 1ULL << (bit & 63);
+    unsigned long long old = atomic_fetch_or_explicit(&set->words[bit >> 6], mask,
+                                                      memory_order_relaxed);
+    return (old & mask) == 0;
+}
+
+// Grows a hash set (or turns an empty set into one) so that it has room for
+// `needed` distinct ids. Only for sets that no other thread is using.
+static int id_set_reserve(IdSet *set, long long needed) {
+    long long slots = set->slots ? set->slot_mask + 1 : 16;
+    if (set->slots && 2 * needed <= slots) {
+        return 1;
+    }
+    while (slots < 2 * needed) {
+        slots *= 2;
+    }
+    IdSet grown;
+    memset(&grown, 0, sizeof(grown));
+    if (!id_set_init_hashed(&grown, slots)) {
+        return 0;
+    }
+    for (long long i = 0; set->slots && i <= set->slot_mask; i++) {
+        long long id = atomic_load_explicit(&set->slots[i], memory_order_relaxed);
+        if (id != -1) {
+            id_set_insert_hashed(&grown, id);
+        }
+    }
+    free((void *)set->slots);
+    *set = grown;
+    return 1;
+}
+
+static void id_set_destroy(IdSet *set) {
+    free((void *)set->words);
+    free((void *)set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+// Days since 1970-01-01 in the proleptic Gregorian calendar.
+static int days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void civil_from_days(int days, int *year, int *month, int *day) {
+    days += 719468;
+    int era = (days >= 0 ? days : days - 146096) / 146097;
+    int doe = days - era * 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp + (mp < 10 ? 3 : -9);
+    *year = yoe + era * 400 + (*month <= 2);
+}
+
+static unsigned long long hash_bytes(const char *text, size_t len) {
+    unsigned long long h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)text[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static int device_dict_init(DeviceDict *dict) {
+    dict->count = 0;
+    dict->capacity = 64;
+    dict->slot_mask = 127;
+    dict->names = (char (*)[DEVICE_NAME_LENGTH])malloc(dict->capacity * sizeof(*dict->names));
+    dict->slots = (int *)malloc((dict->slot_mask + 1) * sizeof(int));
+    if (!dict->names || !dict->slots) {
+        free(dict->names);
+        free(dict->slots);
+        dict->names = NULL;
+        dict->slots = NULL;
+        return 0;
+    }
+    memset(dict->slots, -1, (dict->slot_mask + 1) * sizeof(int));
+    return 1;
+}
+
+static void device_dict_free(DeviceDict *dict) {
+    free(dict->names);
+    free(dict->slots);
+    dict->names = NULL;
+    dict->slots = NULL;
+    dict->count = 0;
+}
+
+static int device_dict_grow(DeviceDict *dict) {
+    if (dict->capacity > INT_MAX / 2) {
+        return 0;
+    }
+    int capacity = dict->capacity * 2;
+    int slot_mask = dict->slot_mask * 2 + 1;
+    char (*names)[DEVICE_NAME_LENGTH] = (char (*)[DEVICE_NAME_LENGTH])realloc(dict->names, capacity * sizeof(*names));
+    int *slots = (int *)malloc((slot_mask + 1) * sizeof(int));
+    if (!names || !slots) {
+        if (names) dict->names = names;
+        free(slots);
+        return 0;
+    }
+    memset(slots, -1, (slot_mask + 1) * sizeof(int));
+    for (int i = 0; i < dict->count; i++) {
+        unsigned long long pos = hash_bytes(names[i], strlen(names[i])) & slot_mask;
+        while (slots[pos] >= 0) {
+            pos = (pos + 1) & slot_mask;
+        }
+        slots[pos] = i;
+    }
+    free(dict->slots);
+    dict->names = names;
+    dict->slots = slots;
+    dict->capacity = capacity;
+    dict->slot_mask = slot_mask;
+    return 1;
+}
+
+// Returns the id of the `len` bytes at `name` (at most DEVICE_NAME_LENGTH - 1,
+// no terminator needed), adding it on first sight, or -1 when out of memory
+// or the dictionary is full.
+static int device_dict_intern_bytes(DeviceDict *dict, const char *name, size_t len) {
+    unsigned long long pos = hash_bytes(name, len) & dict->slot_mask;
+    for (int id; (id = dict->slots[pos]) >= 0; pos = (pos + 1) & dict->slot_mask) {
+        if (memcmp(dict->names[id], name, len) == 0 && dict->names[id][len] == '\0') {
+            return id;
+        }
+    }
+
+    if (dict->count == dict->capacity) {
+        if (!device_dict_grow(dict)) {
+            return -1;
+        }
+        pos = hash_bytes(name, len) & dict->slot_mask;
+        while (dict->slots[pos] >= 0) {
+            pos = (pos + 1) & dict->slot_mask;
+        }
+    }
+    memcpy(dict->names[dict->count], name, len);
+    dict->names[dict->count][len] = '\0';
+    dict->slots[pos] = dict->count;
+    return dict->count++;
+}
+
+// Interns a string, truncated to DEVICE_NAME_LENGTH - 1 characters.
+static int device_dict_intern(DeviceDict *dict, const char *name) {
+    size_t len = strlen(name);
+    if (len > DEVICE_NAME_LENGTH - 1) {
+        len = DEVICE_NAME_LENGTH - 1;
+    }
+    return device_dict_intern_bytes(dict, name, len);
+}
+
+// Like device_dict_intern, but never adds: returns -1 for unknown names.
+static int device_dict_find(const DeviceDict *dict, const char *name) {
+    size_t len = strlen(name);
+    if (len > DEVICE_NAME_LENGTH - 1) {
+        len = DEVICE_NAME_LENGTH - 1;
+    }
+
+    unsigned long long pos = hash_bytes(name, len) & dict->slot_mask;
+    for (int id; (id = dict->slots[pos]) >= 0; pos = (pos + 1) & dict->slot_mask) {
+        if (strncmp(dict->names[id], name, len) == 0 && dict->names[id][len] == '\0') {
+            return id;
+        }
+    }
+    return -1;
+}
+
+static int time_ordinal(TimeBucket bucket, const SensorRecord *record) {
+    int year = record->date / 10000;
+    int month = record->date / 100 % 100;
+
+    switch (bucket) {
+        case BUCKET_YEAR:
+            return year;
+        case BUCKET_MONTH:
+            return year * 12 + month - 1;
+        case BUCKET_DAY:
+            return days_from_civil(year, month, record->date % 100);
+        case BUCKET_HOUR:
+            return days_from_civil(year, month, record->date % 100) * 24 + record->time / 3600;
+        default:
+            return 0;
+    }
+}
+
+static unsigned long long geo_tile(double cell, const SensorRecord *record) {
+    if (!(record->valid & VALID_GEO)) {
+        return GEO_UNKNOWN;
+    }
+    unsigned long long lat = (unsigned long long)floor((record->latitude + 90.0) / cell) & 0xFFFFFF;
+    unsigned long long lon = (unsigned long long)floor((record->longitude + 180.0) / cell) & 0xFFFFFF;
+    return lat | (lon << 24);
+}
+
+static GroupKey group_key(const GroupSpec *spec, const SensorRecord *record) {
+    GroupKey key;
+    unsigned long long device = (unsigned)record->device_id;
+    unsigned long long when = (unsigned)time_ordinal(spec->bucket, record);
+
+    key.lo = (spec->parts & KEY_DEVICE ? device : 0) | (when << 32);
+    key.hi = spec->parts & KEY_GEO ? geo_tile(spec->geo_cell, record) : 0;
+    if (spec->parts & KEY_META) {
+        key.hi |= (unsigned long long)spec->meta->key_of_device[record->device_id] << 48;
+    }
+    return key;
+}
+
+static inline int key_bucket(GroupKey key) {
+    return (int)(unsigned)(key.lo >> 32);
+}
+
+static inline int group_key_equal(GroupKey a, GroupKey b) {
+    return ((a.lo ^ b.lo) | (a.hi ^ b.hi)) == 0;
+}
+
+// Cheap check that two records fall in the same group without building
+// keys: same device and date (and hour, and coordinates when they matter).
+// A 0 does not mean the groups differ.
+static inline int same_group_fast(const GroupSpec *spec, const SensorRecord *a, const SensorRecord *b) {
+    if (a->device_id != b->device_id || a->date != b->date) {
+        return 0;
+    }
+    if (spec->bucket == BUCKET_HOUR && a->time / 3600 != b->time / 3600) {
+        return 0;
+    }
+    if ((spec->parts & KEY_GEO) &&
+        (((a->valid ^ b->valid) & VALID_GEO) || a->latitude != b->latitude || a->longitude != b->longitude)) {
+        return 0;
+    }
+    return 1;
+}
+
+static inline unsigned long long group_hash(GroupKey key) {
+    unsigned long long h = (key.lo ^ (key.hi * 0x9E3779B97F4A7C15ULL)) * 0xC2B2AE3D27D4EB4FULL;
+    return h ^ (h >> 31);
+}
+
+static void initialize_stats(MonthlyStats *stats, GroupKey key) {
+    stats->key = key;
+    
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        stats->max[i] = -INFINITY;
+        stats->min[i] = INFINITY;
+        stats->sum[i] = 0.0;
+        stats->count[i] = 0;
+        stats->out_of_range[i] = 0;
+    }
+    stats->rows = 0;
+    stats->seq_min = 0;
+    stats->seq_max = -1;
+    stats->seq_last = -1;
+    stats->seq_received = 0;
+    stats->seq_reordered = 0;
+}
+
+static void merge_stats(MonthlyStats *dst, const MonthlyStats *src) {
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        dst->max[i] = src->max[i] > dst->max[i] ? src->max[i] : dst->max[i];
+        dst->min[i] = src->min[i] < dst->min[i] ? src->min[i] : dst->min[i];
+        dst->sum[i] += src->sum[i];
+        dst->count[i] += src->count[i];
+        dst->out_of_range[i] += src->out_of_range[i];
+    }
+    dst->rows += src->rows;
+    if (src->seq_received > 0) {
+        if (dst->seq_received == 0 || src->seq_min < dst->seq_min) {
+            dst->seq_min = src->seq_min;
+        }
+        if (src->seq_max > dst->seq_max) {
+            dst->seq_max = src->seq_max;
+        }
+        // Partitions have no order between them, so the last counter is only
+        // taken when dst has none; reorders are summed, which is exact when
+        // each group was aggregated by a single worker.
+        if (dst->seq_received == 0) {
+            dst->seq_last = src->seq_last;
+        }
+        dst->seq_received += src->seq_received;
+        dst->seq_reordered += src->seq_reordered;
+    }
+}
+
+static int stats_table_init(StatsTable *table) {
+    table->count = 0;
+    table->capacity = 256;
+    table->slot_mask = 511;
+    table->entries = (MonthlyStats *)malloc(table->capacity * sizeof(MonthlyStats));
+    table->slots = (long long *)malloc((table->slot_mask + 1) * sizeof(long long));
+    if (!table->entries || !table->slots) {
+        free(table->entries);
+        free(table->slots);
+        table->entries = NULL;
+        table->slots = NULL;
+        return 0;
+    }
+    memset(table->slots, -1, (table->slot_mask + 1) * sizeof(long long));
+    return 1;
+}
+
+static void stats_table_free(StatsTable *table) {
+    free(table->entries);
+    free(table->slots);
+    table->entries = NULL;
+    table->slots = NULL;
+    table->count = 0;
+}
+
+static int stats_table_grow(StatsTable *table) {
+    long long capacity = table->capacity * 2;
+    long long slot_mask = table->slot_mask * 2 + 1;
+    MonthlyStats *entries = (MonthlyStats *)realloc(table->entries, capacity * sizeof(MonthlyStats));
+    long long *slots = (long long *)malloc((slot_mask + 1) * sizeof(long long));
+    if (!entries || !slots) {
+        if (entries) table->entries = entries;
+        free(slots);
+        return 0;
+    }
+    memset(slots, -1, (slot_mask + 1) * sizeof(long long));
+    for (long long i = 0; i < table->count; i++) {
+        unsigned long long pos = group_hash(entries[i].key) & slot_mask;
+        while (slots[pos] >= 0) {
+            pos = (pos + 1) & slot_mask;
+        }
+        slots[pos] = i;
+    }
+    free(table->slots);
+    table->entries = entries;
+    table->slots = slots;
+    table->capacity = capacity;
+    table->slot_mask = slot_mask;
+    return 1;
+}
+
+// Returns the index of the entry for `key`, creating it if needed, or -1
+// when out of memory. Entries keep first-seen order.
+// `hash` is group_hash(key), computed ahead by callers that prefetch.
+static long long stats_table_find_or_add_hashed(StatsTable *table, GroupKey key, unsigned long long hash) {
+    unsigned long long pos = hash & table->slot_mask;
+    for (long long index; (index = table->slots[pos]) >= 0; pos = (pos + 1) & table->slot_mask) {
+        if (group_key_equal(table->entries[index].key, key)) {
+            return index;
+        }
+    }
+
+    if (table->count == table->capacity) {
+        if (!stats_table_grow(table)) {
+            return -1;
+        }
+        pos = hash & table->slot_mask;
+        while (table->slots[pos] >= 0) {
+            pos = (pos + 1) & table->slot_mask;
+        }
+    }
+    initialize_stats(&table->entries[table->count], key);
+    table->slots[pos] = table->count;
+    return table->count++;
+}
+
+static long long stats_table_find_or_add(StatsTable *table, GroupKey key) {
+    return stats_table_find_or_add_hashed(table, key, group_hash(key));
+}
+
+static long long stats_table_find(const StatsTable *table, GroupKey key) {
+    unsigned long long pos = group_hash(key) & table->slot_mask;
+    for (long long index; (index = table->slots[pos]) >= 0; pos = (pos + 1) & table->slot_mask) {
+        if (group_key_equal(table->entries[index].key, key)) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+static int stats_table_copy(StatsTable *dst, const StatsTable *src) {
+    *dst = *src;
+    dst->entries = (MonthlyStats *)malloc(src->capacity * sizeof(MonthlyStats));
+    dst->slots = (long long *)malloc((src->slot_mask + 1) * sizeof(long long));
+    if (!dst->entries || !dst->slots) {
+        stats_table_free(dst);
+        return 0;
+    }
+    memcpy(dst->entries, src->entries, src->count * sizeof(MonthlyStats));
+    memcpy(dst->slots, src->slots, (src->slot_mask + 1) * sizeof(long long));
+    return 1;
+}
+
+static int stats_table_merge(StatsTable *dst, const StatsTable *src) {
+    for (long long i = 0; i < src->count; i++) {
+        long long index = stats_table_find_or_add(dst, src->entries[i].key);
+        if (index < 0) {
+            return 0;
+        }
+        merge_stats(&dst->entries[index], &src->entries[i]);
+    }
+    return 1;
+}
+
+static void process_record_scalar(MonthlyStats *stats, const SensorRecord *record) {
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        int present = (record->valid >> i) & 1;
+        double val = record->values[i];
+        int kept = present & (val >= sensor_min_valid[i]) & (val <= sensor_max_valid[i]);
+
+        stats->max[i] = (kept & (val > stats->max[i])) ? val : stats->max[i];
+        stats->min[i] = (kept & (val < stats->min[i])) ? val : stats->min[i];
+        stats->sum[i] += kept ? val : 0.0;
+        stats->count[i] += kept;
+        stats->out_of_range[i] += present & !kept;
+    }
+    stats->rows++;
+}
+
+static void update_run_scalar(MonthlyStats *stats, const SensorRecord *records, long long count) {
+    MonthlyStats run;
+    initialize_stats(&run, stats->key);
+    for (long long r = 0; r < count; r++) {
+        process_record_scalar(&run, &records[r]);
+    }
+    merge_stats(stats, &run);
+}
+
+// Adds the kept and rejected lane bits of sensors first..first+lanes-1.
+static inline void count_lanes(MonthlyStats *stats, int first, int lanes, int present, int kept) {
+    int rejected = present & ~kept;
+    for (int j = 0; j < lanes; j++) {
+        stats->count[first + j] += (kept >> j) & 1;
+        stats->out_of_range[first + j] += (rejected >> j) & 1;
+    }
+}
+
+#ifdef HAVE_SSE2
+// All-ones lanes for each 2-bit slice of the validity bitmap, so an invalid
+// reading is blended out instead of branched around.
+static const union {
+    unsigned long long bits[2];
+    double lanes[2];
+} sensor_lane_masks[4] = {
+    {{0ULL, 0ULL}},
+    {{~0ULL, 0ULL}},
+    {{0ULL, ~0ULL}},
+    {{~0ULL, ~0ULL}}
+};
+
+static void process_record_sse2(MonthlyStats *stats, const SensorRecord *record) {
+    for (int i = 0; i < NUM_SENSORS; i += 2) {
+        int present = (record->valid >> i) & 3;
+        __m128d val = _mm_loadu_pd(&record->values[i]);
+        __m128d in_range = _mm_and_pd(_mm_cmpge_pd(val, _mm_loadu_pd(&sensor_min_valid[i])),
+                                      _mm_cmple_pd(val, _mm_loadu_pd(&sensor_max_valid[i])));
+        __m128d mask = _mm_and_pd(_mm_loadu_pd(sensor_lane_masks[present].lanes), in_range);
+        __m128d max = _mm_loadu_pd(&stats->max[i]);
+        __m128d min = _mm_loadu_pd(&stats->min[i]);
+        __m128d sum = _mm_loadu_pd(&stats->sum[i]);
+        __m128d kept_val = _mm_and_pd(mask, val);
+
+        max = _mm_or_pd(_mm_and_pd(mask, _mm_max_pd(max, val)), _mm_andnot_pd(mask, max));
+        min = _mm_or_pd(_mm_and_pd(mask, _mm_min_pd(min, val)), _mm_andnot_pd(mask, min));
+        sum = _mm_add_pd(sum, kept_val);
+
+        _mm_storeu_pd(&stats->max[i], max);
+        _mm_storeu_pd(&stats->min[i], min);
+        _mm_storeu_pd(&stats->sum[i], sum);
+
+        count_lanes(stats, i, 2, present, _mm_movemask_pd(mask));
+    }
+    stats->rows++;
+}
+
+// The same blend as process_record_sse2, with the partial max/min/sum kept
+// in registers for the whole run.
+static void update_run_sse2(MonthlyStats *stats, const SensorRecord *records, long long count) {
+    MonthlyStats run;
+    __m128d lo[3], hi[3], max[3], min[3], sum[3];
+
+    initialize_stats(&run, stats->key);
+    for (int k = 0; k < 3; k++) {
+        lo[k] = _mm_loadu_pd(&sensor_min_valid[2 * k]);
+        hi[k] = _mm_loadu_pd(&sensor_max_valid[2 * k]);
+        max[k] = _mm_set1_pd(-INFINITY);
+        min[k] = _mm_set1_pd(INFINITY);
+        sum[k] = _mm_setzero_pd();
+    }
+    for (long long r = 0; r < count; r++) {
+        const SensorRecord *record = &records[r];
+        for (int k = 0; k < 3; k++) {
+            int present = (record->valid >> (2 * k)) & 3;
+            __m128d val = _mm_loadu_pd(&record->values[2 * k]);
+            __m128d in_range = _mm_and_pd(_mm_cmpge_pd(val, lo[k]), _mm_cmple_pd(val, hi[k]));
+            __m128d mask = _mm_and_pd(_mm_loadu_pd(sensor_lane_masks[present].lanes), in_range);
+            __m128d kept_val = _mm_and_pd(mask, val);
+
+            max[k] = _mm_or_pd(_mm_and_pd(mask, _mm_max_pd(max[k], val)), _mm_andnot_pd(mask, max[k]));
+            min[k] = _mm_or_pd(_mm_and_pd(mask, _mm_min_pd(min[k], val)), _mm_andnot_pd(mask, min[k]));
+            sum[k] = _mm_add_pd(sum[k], kept_val);
+            count_lanes(&run, 2 * k, 2, present, _mm_movemask_pd(mask));
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        _mm_storeu_pd(&run.max[2 * k], max[k]);
+        _mm_storeu_pd(&run.min[2 * k], min[k]);
+        _mm_storeu_pd(&run.sum[2 * k], sum[k]);
+    }
+    run.rows = count;
+    merge_stats(stats, &run);
+}
+#endif
+
+#ifdef HAVE_X86_DISPATCH
+// Four sensors from `first`; `lanes` masks off those past NUM_SENSORS so the
+// masked loads and stores never touch the neighbouring fields.
+__attribute__((target("avx2")))
+static inline void update_lanes_avx2(MonthlyStats *stats, const SensorRecord *record, int first, __m256i lanes) {
+    const __m256i bits = _mm256_set_epi64x(8, 4, 2, 1);
+    __m256i valid = _mm256_and_si256(_mm256_set1_epi64x(record->valid >> first), bits);
+    __m256d present = _mm256_castsi256_pd(_mm256_and_si256(lanes, _mm256_cmpeq_epi64(valid, bits)));
+    __m256d val = _mm256_maskload_pd(&record->values[first], lanes);
+    __m256d in_range = _mm256_and_pd(
+        _mm256_cmp_pd(val, _mm256_maskload_pd(&sensor_min_valid[first], lanes), _CMP_GE_OQ),
+        _mm256_cmp_pd(val, _mm256_maskload_pd(&sensor_max_valid[first], lanes), _CMP_LE_OQ));
+    __m256d mask = _mm256_and_pd(present, in_range);
+    __m256d max = _mm256_maskload_pd(&stats->max[first], lanes);
+    __m256d min = _mm256_maskload_pd(&stats->min[first], lanes);
+    __m256d sum = _mm256_maskload_pd(&stats->sum[first], lanes);
+    __m256d kept_val = _mm256_and_pd(mask, val);
+
+    max = _mm256_blendv_pd(max, _mm256_max_pd(max, val), mask);
+    min = _mm256_blendv_pd(min, _mm256_min_pd(min, val), mask);
+    sum = _mm256_add_pd(sum, kept_val);
+
+    _mm256_maskstore_pd(&stats->max[first], lanes, max);
+    _mm256_maskstore_pd(&stats->min[first], lanes, min);
+    _mm256_maskstore_pd(&stats->sum[first], lanes, sum);
+
+    count_lanes(stats, first, NUM_SENSORS - first < 4 ? NUM_SENSORS - first : 4,
+                _mm256_movemask_pd(present), _mm256_movemask_pd(mask));
+}
+
+__attribute__((target("avx2")))
+static void process_record_avx2(MonthlyStats *stats, const SensorRecord *record) {
+    update_lanes_avx2(stats, record, 0, _mm256_set1_epi64x(-1));
+    update_lanes_avx2(stats, record, 4, _mm256_set_epi64x(0, 0, -1, -1));
+    stats->rows++;
+}
+
+__attribute__((target("avx2")))
+static void update_run_avx2(MonthlyStats *stats, const SensorRecord *records, long long count) {
+    const __m256i bits = _mm256_set_epi64x(8, 4, 2, 1);
+    MonthlyStats run;
+    __m256i lanes[2];
+    __m256d lo[2], hi[2], max[2], min[2], sum[2];
+
+    initialize_stats(&run, stats->key);
+    lanes[0] = _mm256_set1_epi64x(-1);
+    lanes[1] = _mm256_set_epi64x(0, 0, -1, -1);
+    for (int k = 0; k < 2; k++) {
+        lo[k] = _mm256_maskload_pd(&sensor_min_valid[4 * k], lanes[k]);
+        hi[k] = _mm256_maskload_pd(&sensor_max_valid[4 * k], lanes[k]);
+        max[k] = _mm256_set1_pd(-INFINITY);
+        min[k] = _mm256_set1_pd(INFINITY);
+        sum[k] = _mm256_setzero_pd();
+    }
+    for (long long r = 0; r < count; r++) {
+        const SensorRecord *record = &records[r];
+        for (int k = 0; k < 2; k++) {
+            __m256i valid = _mm256_and_si256(_mm256_set1_epi64x(record->valid >> (4 * k)), bits);
+            __m256d present = _mm256_castsi256_pd(_mm256_and_si256(lanes[k], _mm256_cmpeq_epi64(valid, bits)));
+            __m256d val = _mm256_maskload_pd(&record->values[4 * k], lanes[k]);
+            __m256d in_range = _mm256_and_pd(_mm256_cmp_pd(val, lo[k], _CMP_GE_OQ),
+                                             _mm256_cmp_pd(val, hi[k], _CMP_LE_OQ));
+            __m256d mask = _mm256_and_pd(present, in_range);
+            __m256d kept_val = _mm256_and_pd(mask, val);
+
+            max[k] = _mm256_blendv_pd(max[k], _mm256_max_pd(max[k], val), mask);
+            min[k] = _mm256_blendv_pd(min[k], _mm256_min_pd(min[k], val), mask);
+            sum[k] = _mm256_add_pd(sum[k], kept_val);
+            count_lanes(&run, 4 * k, k == 0 ? 4 : NUM_SENSORS - 4,
+                        _mm256_movemask_pd(present), _mm256_movemask_pd(mask));
+        }
+    }
+    for (int k = 0; k < 2; k++) {
+        _mm256_maskstore_pd(&run.max[4 * k], lanes[k], max[k]);
+        _mm256_maskstore_pd(&run.min[4 * k], lanes[k], min[k]);
+        _mm256_maskstore_pd(&run.sum[4 * k], lanes[k], sum[k]);
+    }
+    run.rows = count;
+    merge_stats(stats, &run);
+}
+
+// All six sensors in one register; the validity bitmap is the lane mask.
+__attribute__((target("avx512f")))
+static void process_record_avx512(MonthlyStats *stats, const SensorRecord *record) {
+    const __mmask8 lanes = (1u << NUM_SENSORS) - 1;
+    __mmask8 present = record->valid & lanes;
+    __m512d val = _mm512_maskz_loadu_pd(present, record->values);
+    __mmask8 kept = _mm512_mask_cmp_pd_mask(present, val, _mm512_maskz_loadu_pd(lanes, sensor_min_valid), _CMP_GE_OQ);
+    kept = _mm512_mask_cmp_pd_mask(kept, val, _mm512_maskz_loadu_pd(lanes, sensor_max_valid), _CMP_LE_OQ);
+    __m512d kept_val = _mm512_maskz_mov_pd(kept, val);
+
+    _mm512_mask_storeu_pd(stats->max, kept, _mm512_max_pd(_mm512_maskz_loadu_pd(lanes, stats->max), val));
+    _mm512_mask_storeu_pd(stats->min, kept, _mm512_min_pd(_mm512_maskz_loadu_pd(lanes, stats->min), val));
+    _mm512_mask_storeu_pd(stats->sum, kept, _mm512_add_pd(_mm512_maskz_loadu_pd(lanes, stats->sum), kept_val));
+
+    count_lanes(stats, 0, NUM_SENSORS, present, kept);
+    stats->rows++;
+}
+
+__attribute__((target("avx512f")))
+static void update_run_avx512(MonthlyStats *stats, const SensorRecord *records, long long count) {
+    const __mmask8 lanes = (1u << NUM_SENSORS) - 1;
+    const __m512d lo = _mm512_maskz_loadu_pd(lanes, sensor_min_valid);
+    const __m512d hi = _mm512_maskz_loadu_pd(lanes, sensor_max_valid);
+    MonthlyStats run;
+    __m512d max = _mm512_set1_pd(-INFINITY);
+    __m512d min = _mm512_set1_pd(INFINITY);
+    __m512d sum = _mm512_setzero_pd();
+
+    initialize_stats(&run, stats->key);
+    for (long long r = 0; r < count; r++) {
+        __mmask8 present = records[r].valid & lanes;
+        __m512d val = _mm512_maskz_loadu_pd(present, records[r].values);
+        __mmask8 kept = _mm512_mask_cmp_pd_mask(present, val, lo, _CMP_GE_OQ);
+        kept = _mm512_mask_cmp_pd_mask(kept, val, hi, _CMP_LE_OQ);
+        __m512d kept_val = _mm512_maskz_mov_pd(kept, val);
+
+        max = _mm512_mask_max_pd(max, kept, max, val);
+        min = _mm512_mask_min_pd(min, kept, min, val);
+        sum = _mm512_add_pd(sum, kept_val);
+        count_lanes(&run, 0, NUM_SENSORS, present, kept);
+    }
+    _mm512_mask_storeu_pd(run.max, lanes, max);
+    _mm512_mask_storeu_pd(run.min, lanes, min);
+    _mm512_mask_storeu_pd(run.sum, lanes, sum);
+    run.rows = count;
+    merge_stats(stats, &run);
+}
+#endif
+
+// Packet loss is derived from the counter range and the number of counters
+// received, so it does not depend on arrival order and needs no sort.
+static void track_sequence(MonthlyStats *stats, const SensorRecord *record) {
+    long long seq = record->seq;
+    if (seq < 0) {
+        return;
+    }
+
+    if (stats->seq_received == 0 || seq < stats->seq_min) {
+        stats->seq_min = seq;
+    }
+    if (seq > stats->seq_max) {
+        stats->seq_max = seq;
+    }
+    if (seq < stats->seq_last) {
+        stats->seq_reordered++;
+    }
+    stats->seq_last = seq;
+    stats->seq_received++;
+}
+
+static void snapshot_free(Snapshot *snapshot) {
+    stats_table_free(&snapshot->table);
+    free(snapshot);
+}
+
+// Hands a copy of the worker's table to the main thread. The exchange never
+// waits: a snapshot the main thread has not taken yet is simply replaced.
+static void publish_snapshot(ThreadData *data, long long covered) {
+    Snapshot *snapshot = (Snapshot *)malloc(sizeof(Snapshot));
+    if (!snapshot || !stats_table_copy(&snapshot->table, &data->table)) {
+        free(snapshot);
+        return;
+    }
+    snapshot->covered = covered;
+
+    Snapshot *stale = atomic_exchange_explicit(&data->published, snapshot, memory_order_acq_rel);
+    if (stale) {
+        snapshot_free(stale);
+    }
+}
+
+// Short spans are cheaper record by record than through a run reduction.
+static inline void update_span(MonthlyStats *stats, const SensorRecord *records, long long count) {
+    if (count >= 4) {
+        kernels.update_run(stats, records, count);
+        return;
+    }
+    for (long long k = 0; k < count; k++) {
+        kernels.update_stats(stats, &records[k]);
+    }
+}
+
+static void *process_records(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    ProgressControl *progress = data->progress;
+    if (data->failed) {
+        if (progress) {
+            atomic_store_explicit(&data->done, 1, memory_order_release);
+        }
+        return NULL;
+    }
+    
+    StatsTable *table = &data->table;
+    const GroupSpec *spec = data->spec;
+    const SensorRecord *records = data->records;
+    unsigned int seen_request = progress ? atomic_load_explicit(&progress->request, memory_order_relaxed) : 0;
+    long long last_published = data->start;
+    long long next_report = data->start;
+    long long i = data->start;
+    while (i < data->end && !data->failed) {
+        if (i >= next_report) {
+            next_report = i + 1024;
+            atomic_store_explicit(&data->processed, i - data->start, memory_order_relaxed);
+            if (progress) {
+                unsigned int request = atomic_load_explicit(&progress->request, memory_order_relaxed);
+                if (request != seen_request ||
+                    (progress->every_rows > 0 && i - last_published >= progress->every_rows)) {
+                    publish_snapshot(data, i - data->start);
+                    seen_request = request;
+                    last_published = i;
+                }
+            }
+        }
+
+        // Split the input into runs of consecutive records of one group;
+        // sorted exports give long runs, and each costs a single lookup.
+        // Runs go through in batches so their cache misses overlap: hash
+        // every head and prefetch its bucket, then resolve the buckets and
+        // prefetch the entries, then reduce each run into its entry.
+        long long run_start[AGG_BATCH + 1];
+        GroupKey keys[AGG_BATCH];
+        unsigned long long hashes[AGG_BATCH];
+        long long indices[AGG_BATCH];
+        int runs = 0;
+        long long j = i;
+        GroupKey next_key;
+        int has_next_key = 0;      // the key that ended the previous run
+
+        while (runs < AGG_BATCH && j < data->end) {
+            const SensorRecord *head = &records[j];
+            int undated = head->date == 0;
+            keys[runs] = has_next_key ? next_key : group_key(spec, head);
+            has_next_key = 0;
+            run_start[runs] = j;
+            for (j++; j < data->end && j - run_start[runs] < MAX_RUN; j++) {
+                if (same_group_fast(spec, &records[j - 1], &records[j])) {
+                    continue;
+                }
+                if ((records[j].date == 0) == undated) {
+                    next_key = group_key(spec, &records[j]);
+                    if (group_key_equal(next_key, keys[runs])) {
+                        continue;
+                    }
+                    has_next_key = 1;
+                }
+                break;
+            }
+            hashes[runs] = group_hash(keys[runs]);
+            PREFETCH(&table->slots[hashes[runs] & table->slot_mask]);
+            id_set_prefetch(data->seen_ids, head->id);
+            runs++;
+        }
+        run_start[runs] = j;
+
+        for (int r = 0; r < runs; r++) {
+            indices[r] = -1;
+            if (records[run_start[r]].date == 0 && (spec->parts & KEY_TIME)) {
+                continue;
+            }
+            indices[r] = stats_table_find_or_add_hashed(table, keys[r], hashes[r]);
+            if (indices[r] < 0) {
+                data->failed = 1;
+                break;
+            }
+            PREFETCH(&table->entries[indices[r]]);
+        }
+
+        for (int r = 0; r < runs && !data->failed; r++) {
+            MonthlyStats *stats = indices[r] >= 0 ? &table->entries[indices[r]] : NULL;
+            long long span = run_start[r];
+            // Duplicates split the run; the spans between them are reduced.
+            for (long long k = run_start[r]; k < run_start[r + 1]; k++) {
+                if (!id_set_insert(data->seen_ids, records[k].id)) {
+                    data->duplicates++;
+                    if (stats) {
+                        update_span(stats, &records[span], k - span);
+                    }
+                    span = k + 1;
+                } else if (stats) {
+                    track_sequence(stats, &records[k]);
+                }
+            }
+            if (stats) {
+                update_span(stats, &records[span], run_start[r + 1] - span);
+            }
+        }
+        i = j;
+    }
+    atomic_store_explicit(&data->processed, data->end - data->start, memory_order_relaxed);
+    
+    if (progress) {
+        if (!data->failed) {
+            publish_snapshot(data, data->end - data->start);
+        }
+        atomic_store_explicit(&data->done, 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static const char *bucket_headers[] = {"", "ano", "ano-mes", "data", "data-hora"};
+
+// Writes the header columns for the key parts selected by `parts`, each
+// followed by ';'.
+static void print_key_header(FILE *file, const GroupSpec *spec, int parts) {
+    parts &= spec->parts;
+    if (parts & KEY_DEVICE) {
+        fprintf(file, "device;");
+        for (int i = 0; spec->meta && i < spec->meta->num_attrs; i++) {
+            fprintf(file, "%s;", spec->meta->attr_names[i]);
+        }
+    }
+    if (parts & KEY_TIME) {
+        fprintf(file, "%s;", bucket_headers[spec->bucket]);
+    }
+    if (parts & KEY_GEO) {
+        fprintf(file, "geo;");
+    }
+    if ((parts & KEY_META) && !(parts & KEY_DEVICE)) {
+        fprintf(file, "%s;", spec->meta_attr);
+    }
+}
+
+static void print_key(FILE *file, const GroupSpec *spec, const DeviceDict *dict, GroupKey key, int parts) {
+    parts &= spec->parts;
+    if (parts & KEY_DEVICE) {
+        int device = (int)(unsigned)key.lo;
+        fprintf(file, "%s;", dict->names[device]);
+        if (spec->meta) {
+            int row = spec->meta->row_of_device[device];
+            for (int i = 0; i < spec->meta->num_attrs; i++) {
+                fprintf(file, "%s;", row >= 0 ? spec->meta->values[row][i] : "");
+            }
+        }
+    }
+    if (parts & KEY_TIME) {
+        int ordinal = key_bucket(key);
+        int year, month, day;
+        switch (spec->bucket) {
+            case BUCKET_YEAR:
+                fprintf(file, "%04d;", ordinal);
+                break;
+            case BUCKET_MONTH:
+                fprintf(file, "%04d-%02d;", ordinal / 12, ordinal % 12 + 1);
+                break;
+            case BUCKET_DAY:
+                civil_from_days(ordinal, &year, &month, &day);
+                fprintf(file, "%04d-%02d-%02d;", year, month, day);
+                break;
+            case BUCKET_HOUR:
+                civil_from_days(ordinal / 24, &year, &month, &day);
+                fprintf(file, "%04d-%02d-%02d %02d;", year, month, day, ordinal % 24);
+                break;
+            default:
+                break;
+        }
+    }
+    if (parts & KEY_GEO) {
+        if (key.hi == GEO_UNKNOWN) {
+            fprintf(file, "-;");
+        } else {
+            fprintf(file, "%.6f,%.6f;",
+                    (double)(key.hi & 0xFFFFFF) * spec->geo_cell - 90.0,
+                    (double)((key.hi >> 24) & 0xFFFFFF) * spec->geo_cell - 180.0);
+        }
+    }
+    if ((parts & KEY_META) && !(parts & KEY_DEVICE)) {
+        unsigned value = (unsigned)(key.hi >> 48);
+        fprintf(file, "%s;", value == META_UNKNOWN ? "-" : spec->meta->key_values.names[value]);
+    }
+}
+
+static GroupKey mask_key(GroupKey key, int parts) {
+    GroupKey masked;
+    masked.lo = key.lo & ((parts & KEY_DEVICE ? 0xFFFFFFFFULL : 0) |
+                          (parts & KEY_TIME ? 0xFFFFFFFF00000000ULL : 0));
+    masked.hi = key.hi & ((parts & KEY_GEO ? GEO_UNKNOWN : 0) |
+                          (parts & KEY_META ? 0xFFFF000000000000ULL : 0));
+    return masked;
+}
+
+// Folds a table into a coarser one that only keeps the key parts in `parts`.
+static int rollup_table(const StatsTable *src, int parts, StatsTable *dst) {
+    if (!stats_table_init(dst)) {
+        return 0;
+    }
+    for (long long i = 0; i < src->count; i++) {
+        long long index = stats_table_find_or_add(dst, mask_key(src->entries[i].key, parts));
+        if (index < 0) {
+            stats_table_free(dst);
+            return 0;
+        }
+        merge_stats(&dst->entries[index], &src->entries[i]);
+    }
+    return 1;
+}
+
+// Student's t for a two-sided 95% interval, by degrees of freedom; past
+// the table the normal 1.96 is close enough.
+static const double t_quantiles[] = {
+    0.0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145,
+    2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+#define NUM_T_QUANTILES ((int)(sizeof(t_quantiles) / sizeof(t_quantiles[0])))
+
+// The 95% confidence half-width of every group's sampled mean, at
+// intervals[entry * NUM_SENSORS + sensor], for the groups of `table` keyed
+// by the `parts` of `spec`. Readings of one block are far from independent,
+// above all in sorted exports, so the sampled blocks are the units: each
+// group's deviations from its mean are summed per block, and the spread of
+// those sums across blocks gives the variance of a ratio estimator. Few
+// blocks give a rough variance, so the half-width takes Student's t with
+// one degree of freedom less than the blocks the sensor was read in. A
+// sensor read in fewer than two blocks has no spread to measure and gets -1.
+// Returns NULL when out of memory.
+static double *block_intervals(const StatsTable *table, const GroupSpec *spec, int parts,
+                               const BlockSample *sample) {
+    long long m = sample->num_blocks;
+    double *intervals = (double *)calloc((size_t)(table->count > 0 ? table->count : 1) * NUM_SENSORS,
+                                         sizeof(double));
+    double *block_sums = (double *)calloc((size_t)(table->count > 0 ? table->count : 1) * NUM_SENSORS,
+                                          sizeof(double));
+    long long *touched = (long long *)malloc((table->count > 0 ? table->count : 1) * sizeof(long long));
+    long long *last_block = (long long *)malloc((table->count > 0 ? table->count : 1) * sizeof(long long));
+    int *block_readings = (int *)calloc((size_t)(table->count > 0 ? table->count : 1) * NUM_SENSORS, sizeof(int));
+    int *blocks_read = (int *)calloc((size_t)(table->count > 0 ? table->count : 1) * NUM_SENSORS, sizeof(int));
+    long long *starts = (long long *)calloc(m + 2, sizeof(long long));
+    long long *order = (long long *)malloc((sample->count > 0 ? sample->count : 1) * sizeof(long long));
+    if (!intervals || !block_sums || !touched || !last_block || !block_readings || !blocks_read || !starts || !order) {
+        free(intervals);
+        free(block_sums);
+        free(touched);
+        free(last_block);
+        free(block_readings);
+        free(blocks_read);
+        free(starts);
+        free(order);
+        return NULL;
+    }
+
+    // Sorting by device scatters the blocks, so visit the records through an
+    // index ordered by block.
+    for (long long i = 0; i < sample->count; i++) {
+        starts[sample->records[i].block + 2]++;
+    }
+    for (long long b = 0; b < m; b++) {
+        starts[b + 2] += starts[b + 1];
+    }
+    for (long long i = 0; i < sample->count; i++) {
+        order[starts[sample->records[i].block + 1]++] = i;
+    }
+    for (long long e = 0; e < table->count; e++) {
+        last_block[e] = -1;
+    }
+
+    for (long long b = 0; b < m; b++) {
+        long long num_touched = 0;
+        for (long long k = starts[b]; k < starts[b + 1]; k++) {
+            const SensorRecord *record = &sample->records[order[k]];
+            if (record->date == 0 && (spec->parts & KEY_TIME)) {
+                continue;
+            }
+            long long e = stats_table_find(table, mask_key(group_key(spec, record), parts));
+            if (e < 0) {
+                continue;
+            }
+            if (last_block[e] != b) {
+                last_block[e] = b;
+                touched[num_touched++] = e;
+            }
+            const MonthlyStats *stats = &table->entries[e];
+            for (int j = 0; j < NUM_SENSORS; j++) {
+                double val = record->values[j];
+                if (((record->valid >> j) & 1) && val >= sensor_min_valid[j] && val <= sensor_max_valid[j]) {
+                    block_sums[(size_t)e * NUM_SENSORS + j] += val - stats->sum[j] / stats->count[j];
+                    block_readings[(size_t)e * NUM_SENSORS + j]++;
+                }
+            }
+        }
+        for (long long t = 0; t < num_touched; t++) {
+            size_t first = (size_t)touched[t] * NUM_SENSORS;
+            for (int j = 0; j < NUM_SENSORS; j++) {
+                intervals[first + j] += block_sums[first + j] * block_sums[first + j];
+                blocks_read[first + j] += block_readings[first + j] > 0;
+                block_sums[first + j] = 0.0;
+                block_readings[first + j] = 0;
+            }
+        }
+    }
+
+    // Blocks without the group count as sums of zero. With n readings over
+    // m blocks, Var = (1 - f) / (m (m - 1)) * sum of squares / (n / m)^2.
+    for (long long e = 0; e < table->count; e++) {
+        for (int j = 0; j < NUM_SENSORS; j++) {
+            double n = (double)table->entries[e].count[j];
+            int df = blocks_read[(size_t)e * NUM_SENSORS + j] - 1;
+            double *interval = &intervals[(size_t)e * NUM_SENSORS + j];
+            double variance = (1.0 - sample->block_fraction) * m / (m - 1) * *interval / (n * n);
+            *interval = df > 0 ? (df < NUM_T_QUANTILES ? t_quantiles[df] : 1.96) * sqrt(variance) : -1.0;
+        }
+    }
+    free(block_sums);
+    free(touched);
+    free(last_block);
+    free(block_readings);
+    free(blocks_read);
+    free(starts);
+    free(order);
+    return intervals;
+}
+
+// `coverage` is the fraction of the input that was read. Below 1 the rows
+// are estimates: each gets the 95% confidence half-width of the mean from
+// `intervals` (see block_intervals; empty without them) and the reading
+// count scaled up to the whole input. Max and min are those of the sample.
+// Writes one line per group and sensor in `sensors` (a bit per sensor).
+static void write_results(FILE *file, const MonthlyStats *results, long long count, const GroupSpec *spec,
+                          const DeviceDict *dict, double coverage, const double *intervals, int sensors) {
+    print_key_header(file, spec, ~0);
+    fprintf(file, "sensor;valor_maximo;valor_medio;valor_minimo%s\n",
+            coverage < 1.0 ? ";ic95_medio;leituras_estimadas" : "");
+    
+    for (long long i = 0; i < count; i++) {
+        for (int j = 0; j < NUM_SENSORS; j++) {
+            if (results[i].count[j] > 0 && ((sensors >> j) & 1)) {
+                double avg = results[i].sum[j] / results[i].count[j];
+                print_key(file, spec, dict, results[i].key, ~0);
+                fprintf(file, "%s;%.2f;%.2f;%.2f",
+                        sensor_names[j],
+                        results[i].max[j],
+                        avg,
+                        results[i].min[j]);
+                if (coverage < 1.0) {
+                    double interval = intervals ? intervals[(size_t)i * NUM_SENSORS + j] : -1.0;
+                    if (interval >= 0.0) {
+                        fprintf(file, ";%.2f", interval);
+                    } else {
+                        fprintf(file, ";");
+                    }
+                    fprintf(file, ";%.0f", results[i].count[j] / coverage);
+                }
+                fprintf(file, "\n");
+            }
+        }
+    }
+}
+
+static void write_results_to_csv(const MonthlyStats *results, long long count, const GroupSpec *spec,
+                                 const DeviceDict *dict, double coverage, const double *intervals,
+                                 const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        perror("Failed to open output file");
+        return;
+    }
+    write_results(file, results, count, spec, dict, coverage, intervals, ALL_SENSORS);
+    fclose(file);
+}
+
+// Splits off the next '|'-separated field in place. Unlike strtok, empty
+// fields are kept so that a missing reading does not shift later columns.
+static char *next_field(char **cursor) {
+    char *start = *cursor;
+    char *sep = strchr(start, '|');
+
+    if (sep) {
+        *sep = '\0';
+        *cursor = sep + 1;
+    } else {
+        *cursor = NULL;
+    }
+    return start;
+}
+
+// The token parsers below take the bytes in [token, end); fields are never
+// copied or terminated.
+static long long parse_counter(const char *token, const char *end) {
+    while (token < end && isspace((unsigned char)*token)) {
+        token++;
+    }
+    if (token < end && *token == '+') {
+        token++;
+    }
+    if (token == end || !isdigit((unsigned char)*token)) {
+        return -1;
+    }
+    long long value = 0;
+    for (; token < end && isdigit((unsigned char)*token); token++) {
+        if (value > (0x7FFFFFFFFFFFFFFFLL - 9) / 10) {
+            return -1;
+        }
+        value = value * 10 + (*token - '0');
+    }
+    return value;
+}
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19
+};
+
+// Like strtod on the leading number of the token. Plain decimals with at
+// most 15 digits, the usual case, are exact integers divided by an exact
+// power of ten, which rounds the same as strtod; anything else (exponents,
+// hex, long mantissas, inf/nan) is copied out and handed to strtod.
+static int parse_sensor_value(const char *token, const char *end, double *value) {
+    while (token < end && isspace((unsigned char)*token)) {
+        token++;
+    }
+    if (token == end) {
+        return 0;
+    }
+
+    const char *p = token;
+    int negative = *p == '-';
+    if (*p == '-' || *p == '+') {
+        p++;
+    }
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int decimals = 0;
+    for (; p < end && isdigit((unsigned char)*p); p++, digits++) {
+        mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && isdigit((unsigned char)*p); p++, digits++, decimals++) {
+            mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+        }
+    }
+    if (digits > 0 && digits <= 15 && !(p < end && isalpha((unsigned char)*p))) {
+        double magnitude = (double)mantissa / powers_of_ten[decimals];
+        *value = negative ? -magnitude : magnitude;
+        return 1;
+    }
+
+    char buffer[MAX_FIELD_LENGTH + 1];
+    char *parsed_end;
+    size_t len = (size_t)(end - token);
+    if (len > MAX_FIELD_LENGTH) {
+        len = MAX_FIELD_LENGTH;
+    }
+    memcpy(buffer, token, len);
+    buffer[len] = '\0';
+    *value = strtod(buffer, &parsed_end);
+    return parsed_end != buffer;
+}
+
+// `ordered` is set when every group's counters were seen in one device-ordered
+// pass; otherwise where workers split the records decides what counts as out
+// of order, so fora_de_ordem is left empty.
+static void write_gaps_to_csv(const MonthlyStats *results, long long count, const GroupSpec *spec,
+                              const DeviceDict *dict, int ordered, const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        perror("Failed to open gaps file");
+        return;
+    }
+
+    print_key_header(file, spec, ~0);
+    fprintf(file, "recebidos;esperados;perdidos;fora_de_ordem\n");
+
+    for (long long i = 0; i < count; i++) {
+        if (results[i].seq_received == 0) {
+            continue;
+        }
+        long long expected = results[i].seq_max - results[i].seq_min + 1;
+        long long lost = expected - results[i].seq_received;
+        print_key(file, spec, dict, results[i].key, ~0);
+        fprintf(file, "%lld;%lld;%lld;",
+                results[i].seq_received,
+                expected,
+                lost > 0 ? lost : 0);
+        if (ordered) {
+            fprintf(file, "%lld", results[i].seq_reordered);
+        }
+        fprintf(file, "\n");
+    }
+
+    fclose(file);
+}
+
+static void write_quality_to_csv(const MonthlyStats *results, long long count, const GroupSpec *spec,
+                                 const DeviceDict *dict, const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        perror("Failed to open quality file");
+        return;
+    }
+
+    print_key_header(file, spec, ~0);
+    fprintf(file, "sensor;leituras;ausentes;fora_da_faixa\n");
+
+    for (long long i = 0; i < count; i++) {
+        for (int j = 0; j < NUM_SENSORS; j++) {
+            print_key(file, spec, dict, results[i].key, ~0);
+            fprintf(file, "%s;%lld;%lld;%lld\n",
+                    sensor_names[j],
+                    results[i].count[j],
+                    results[i].rows - results[i].count[j] - results[i].out_of_range[j],
+                    results[i].out_of_range[j]);
+        }
+    }
+
+    fclose(file);
+}
+
+// Writes every coarser level of the grouping (the cube over its key parts)
+// to "<prefix>_<parts>.csv", e.g. per device over all time, fleet-wide per
+// month and a grand total for the default grouping. Each level is merged
+// from an already computed parent one part finer, so the cost depends on the
+// number of groups, not rows. A sampled run passes its `sample`; each level
+// then also takes a pass over the sampled rows for its block intervals.
+static int write_rollups_to_csv(const StatsTable *table, const GroupSpec *spec, const DeviceDict *dict,
+                                double coverage, const BlockSample *sample, const char *prefix) {
+    static const char *bucket_names[] = {"", "year", "month", "day", "hour"};
+    StatsTable levels[16];
+
+    levels[spec->parts] = *table;
+    for (int parts = spec->parts - 1; parts >= 0; parts--) {
+        if ((parts & ~spec->parts) != 0) {
+            continue;
+        }
+        int missing = spec->parts & ~parts;
+        int parent = parts | (missing & -missing);
+        if (!rollup_table(&levels[parent], parts, &levels[parts])) {
+            perror("Memory allocation failed");
+            for (int done = parts + 1; done < spec->parts; done++) {
+                if ((done & ~spec->parts) == 0) {
+                    stats_table_free(&levels[done]);
+                }
+            }
+            return 0;
+        }
+    }
+
+    for (int parts = spec->parts - 1; parts >= 0; parts--) {
+        if ((parts & ~spec->parts) != 0) {
+            continue;
+        }
+        char filename[256];
+        GroupSpec level_spec = *spec;
+        level_spec.parts = parts;
+        snprintf(filename, sizeof(filename), "%s%s%s%s%s%s%s%s.csv", prefix,
+                 parts & KEY_DEVICE ? "_device" : "",
+                 parts & KEY_TIME ? "_" : "",
+                 parts & KEY_TIME ? bucket_names[spec->bucket] : "",
+                 parts & KEY_GEO ? "_geo" : "",
+                 parts & KEY_META ? "_" : "",
+                 parts & KEY_META ? spec->meta_attr : "",
+                 parts == 0 ? "_total" : "");
+        double *intervals = NULL;
+        if (sample && !(intervals = block_intervals(&levels[parts], spec, parts, sample))) {
+            perror("Memory allocation failed");
+            for (int rest = parts; rest >= 0; rest--) {
+                if ((rest & ~spec->parts) == 0) {
+                    stats_table_free(&levels[rest]);
+                }
+            }
+            return 0;
+        }
+        write_results_to_csv(levels[parts].entries, levels[parts].count, &level_spec, dict,
+                             coverage, intervals, filename);
+        printf("Rollup written to %s\n", filename);
+        free(intervals);
+        stats_table_free(&levels[parts]);
+    }
+    return 1;
+}
+
+// Merges the latest snapshot of every worker and writes it through a
+// temporary file, so readers never see a half-written result. Returns 0
+// when the merge or the file fails.
+static int write_partial_results(Snapshot **latest, int num_threads, double fraction_of_records,
+                                 const GroupSpec *spec, const DeviceDict *dict, const char *filename) {
+    StatsTable merged;
+    char temp_filename[256];
+
+    if (!stats_table_init(&merged)) {
+        return 0;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (latest[i] && !stats_table_merge(&merged, &latest[i]->table)) {
+            stats_table_free(&merged);
+            return 0;
+        }
+    }
+    snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+    FILE *file = fopen(temp_filename, "w");
+    if (!file) {
+        perror("Failed to open partial results");
+        stats_table_free(&merged);
+        return 0;
+    }
+    write_results(file, merged.entries, merged.count, spec, dict, 1.0, NULL, ALL_SENSORS);
+    stats_table_free(&merged);
+    if (ferror(file) | fclose(file)) {
+        perror("Failed to write partial results");
+        remove(temp_filename);
+        return 0;
+    }
+#ifdef _WIN32
+    remove(filename);
+#endif
+    if (rename(temp_filename, filename) != 0) {
+        perror("Failed to replace partial results");
+        return 0;
+    }
+    printf("Partial results for %.1f%% of records written to %s\n", fraction_of_records * 100.0, filename);
+    fflush(stdout);
+    return 1;
+}
+
+// Runs on the main thread while the workers aggregate. Every `seconds` it asks
+// the workers for snapshots (with `seconds` 0 they publish on their own every
+// `every_rows` rows), takes whatever was published and writes the merge.
+// Returns once every worker has published its final table. A failed
+// partial write only stops further partial writes; the final report does
+// not depend on them.
+static void watch_progress(ThreadData *thread_data, int num_threads, long long record_count, double coverage,
+                          ProgressControl *progress, int seconds,
+                          const GroupSpec *spec, const DeviceDict *dict, const char *filename) {
+    Snapshot **latest = (Snapshot **)calloc(num_threads, sizeof(Snapshot *));
+    int finished = 0;
+    int ok = latest != NULL;
+
+    while (finished < num_threads) {
+        if (seconds > 0) {
+            atomic_fetch_add_explicit(&progress->request, 1, memory_order_relaxed);
+        }
+        // Sleep in short slices so the run ends as soon as the workers do.
+        for (int slept = 0; slept < (seconds > 0 ? seconds * 1000 : 100); slept += 100) {
+            int done = 0;
+            for (int i = 0; i < num_threads; i++) {
+                done += atomic_load_explicit(&thread_data[i].done, memory_order_relaxed);
+            }
+            if (done == num_threads) {
+                break;
+            }
+            sleep_ms(100);
+        }
+
+        int fresh = 0;
+        long long covered = 0;
+        finished = 0;
+        for (int i = 0; i < num_threads; i++) {
+            // Read `done` first: once it is set the final snapshot is already
+            // published, so the exchange below cannot miss it.
+            finished += atomic_load_explicit(&thread_data[i].done, memory_order_acquire);
+            Snapshot *snapshot = atomic_exchange_explicit(&thread_data[i].published, NULL, memory_order_acq_rel);
+            if (snapshot && ok) {
+                if (latest[i]) {
+                    snapshot_free(latest[i]);
+                }
+                latest[i] = snapshot;
+                fresh = 1;
+            } else if (snapshot) {
+                snapshot_free(snapshot);
+            }
+            if (ok && latest[i]) {
+                covered += latest[i]->covered;
+            }
+        }
+        // The complete result follows right after the last worker finishes.
+        if (ok && fresh && finished < num_threads &&
+            !write_partial_results(latest, num_threads, coverage * covered / record_count,
+                                   spec, dict, filename)) {
+            fprintf(stderr, "Partial results stopped; the final results are still written\n");
+            ok = 0;
+        }
+    }
+
+    for (int i = 0; latest && i < num_threads; i++) {
+        if (latest[i]) {
+            snapshot_free(latest[i]);
+        }
+    }
+    free(latest);
+}
+
+static void print_eta(double remaining, double rate) {
+    if (rate > 0.0) {
+        fprintf(stderr, ", ETA %.0fs", remaining / rate);
+    }
+}
+
+static void print_status(RunStatus *status, int phase, double elapsed) {
+    long long bytes = atomic_load_explicit(&status->bytes_read, memory_order_relaxed);
+    long long bytes_total = atomic_load_explicit(&status->bytes_total, memory_order_relaxed);
+    long long rows = atomic_load_explicit(&status->rows_parsed, memory_order_relaxed);
+
+    fprintf(stderr, "[%s %.0fs]", phase_names[phase], elapsed);
+    if (phase == PHASE_COUNTING || phase == PHASE_PARSING) {
+        double byte_rate = elapsed > 0.0 ? bytes / elapsed : 0.0;
+        if (phase == PHASE_PARSING) {
+            fprintf(stderr, " %lld rows parsed (%.0f rows/s),", rows, elapsed > 0.0 ? rows / elapsed : 0.0);
+        }
+        fprintf(stderr, " %.1f of %.1f MB read", bytes / 1048576.0, bytes_total / 1048576.0);
+        print_eta((double)(bytes_total - bytes), byte_rate);
+        fprintf(stderr, "\n");
+    } else if (phase == PHASE_AGGREGATING) {
+        int num_workers = atomic_load_explicit(&status->num_workers, memory_order_acquire);
+        long long done = 0;
+        for (int i = 0; i < num_workers; i++) {
+            done += atomic_load_explicit(&status->workers[i].processed, memory_order_relaxed);
+        }
+        double rate = elapsed > 0.0 ? done / elapsed : 0.0;
+        fprintf(stderr, " %lld of %lld records (%.0f rows/s)", done, status->records_total, rate);
+        print_eta((double)(status->records_total - done), rate);
+        fprintf(stderr, "\n");
+        for (int i = 0; i < num_workers; i++) {
+            ThreadData *worker = &status->workers[i];
+            fprintf(stderr, "  thread %d: %lld of %lld\n", i,
+                    atomic_load_explicit(&worker->processed, memory_order_relaxed), worker->end - worker->start);
+        }
+    } else {
+        fprintf(stderr, "\n");
+    }
+}
+
+// Wakes a few times a second and prints the run status to stderr when
+// iot_request_status was called or the periodic interval elapsed. Rates are per phase.
+static void *report_status(void *arg) {
+    RunStatus *status = (RunStatus *)arg;
+    int seen_phase = PHASE_STARTING;
+    double phase_started = now_seconds();
+    double last_report = phase_started;
+
+    while (!atomic_load_explicit(&status->stop, memory_order_acquire)) {
+        sleep_ms(200);
+        double now = now_seconds();
+        int phase = atomic_load_explicit(&status->phase, memory_order_relaxed);
+        if (phase != seen_phase) {
+            seen_phase = phase;
+            phase_started = now;
+        }
+        if (atomic_exchange_explicit(&status_requested, 0, memory_order_relaxed) ||
+            (status->every_seconds > 0 && now - last_report >= status->every_seconds)) {
+            last_report = now;
+            print_status(status, phase, now - phase_started);
+        }
+    }
+    return NULL;
+}
+
+static void stop_status_reporter(pthread_t reporter) {
+    if (run_status.running) {
+        atomic_store_explicit(&run_status.stop, 1, memory_order_release);
+        pthread_join(reporter, NULL);
+        run_status.running = 0;
+    }
+}
+
+// Parses "sensor=min:max"; either bound may be empty to leave it open. A
+// range with min above max (or a NaN bound) would reject every reading, so
+// it is refused.
+static int parse_range_option(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    const char *colon = eq ? strchr(eq + 1, ':') : NULL;
+    if (!eq || !colon) {
+        return 0;
+    }
+
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        if (strlen(sensor_names[i]) == (size_t)(eq - spec) &&
+            strncmp(sensor_names[i], spec, eq - spec) == 0) {
+            char *end;
+            double lo = colon == eq + 1 ? -INFINITY : strtod(eq + 1, &end);
+            if (colon != eq + 1 && end != colon) {
+                return 0;
+            }
+            double hi = colon[1] == '\0' ? INFINITY : strtod(colon + 1, &end);
+            if ((colon[1] != '\0' && *end != '\0') || !(lo <= hi)) {
+                return 0;
+            }
+            sensor_min_valid[i] = lo;
+            sensor_max_valid[i] = hi;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int stat_value(const MonthlyStats *stats, int sensor, StatKind stat, double *value) {
+    if (stats->count[sensor] == 0) {
+        return 0;
+    }
+    switch (stat) {
+        case STAT_MAX:
+            *value = stats->max[sensor];
+            break;
+        case STAT_AVG:
+            *value = stats->sum[sensor] / stats->count[sensor];
+            break;
+        case STAT_MIN:
+            *value = stats->min[sensor];
+            break;
+    }
+    return 1;
+}
+
+// Ties are broken on the results index so the ranking does not depend on
+// how the entries were split between threads.
+static int top_entry_weaker(const TopEntry *a, const TopEntry *b) {
+    return a->key < b->key || (a->key == b->key && a->index > b->index);
+}
+
+static void top_heap_sift_down(TopHeap *heap, int pos) {
+    TopEntry *e = heap->entries;
+    for (;;) {
+        int weakest = pos;
+        int left = 2 * pos + 1;
+        int right = left + 1;
+        if (left < heap->size && top_entry_weaker(&e[left], &e[weakest])) {
+            weakest = left;
+        }
+        if (right < heap->size && top_entry_weaker(&e[right], &e[weakest])) {
+            weakest = right;
+        }
+        if (weakest == pos) {
+            return;
+        }
+        TopEntry tmp = e[pos];
+        e[pos] = e[weakest];
+        e[weakest] = tmp;
+        pos = weakest;
+    }
+}
+
+static void top_heap_push(TopHeap *heap, TopEntry entry) {
+    TopEntry *e = heap->entries;
+    if (heap->size < heap->capacity) {
+        int pos = heap->size++;
+        while (pos > 0 && top_entry_weaker(&entry, &e[(pos - 1) / 2])) {
+            e[pos] = e[(pos - 1) / 2];
+            pos = (pos - 1) / 2;
+        }
+        e[pos] = entry;
+    } else if (top_entry_weaker(&e[0], &entry)) {
+        e[0] = entry;
+        top_heap_sift_down(heap, 0);
+    }
+}
+
+static void *top_k_worker(void *arg) {
+    TopKThreadData *data = (TopKThreadData *)arg;
+    const TopKQuery *query = data->query;
+
+    for (long long i = data->start; i < data->end; i++) {
+        const MonthlyStats *stats = &data->results[i];
+        TopEntry entry;
+        if (!stat_value(stats, query->sensor, query->stat, &entry.key)) {
+            continue;
+        }
+        if (query->ascending) {
+            entry.key = -entry.key;
+        }
+        entry.index = i;
+        int bucket = key_bucket(stats->key);
+        long long lo = 0, hi = data->num_buckets - 1;
+        while (lo < hi) {
+            long long mid = (lo + hi) / 2;
+            if (data->buckets[mid] < bucket) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        top_heap_push(&data->heaps[lo], entry);
+    }
+
+    return NULL;
+}
+
+static int compare_buckets(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Ranks groups within each time bucket. Each thread keeps a bounded heap per
+// bucket that occurs in the results over its share of them; the per-thread
+// heaps are then merged, so only k entries per bucket are ever sorted.
+static void write_top_k_to_csv(const MonthlyStats *results, long long count, const GroupSpec *spec,
+                               const DeviceDict *dict, const TopKQuery *query,
+                               int num_threads, const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        perror("Failed to open top-k file");
+        return;
+    }
+
+    print_key_header(file, spec, KEY_TIME);
+    fprintf(file, "posicao;");
+    print_key_header(file, spec, ~KEY_TIME);
+    fprintf(file, "sensor;estatistica;valor\n");
+    if (count == 0) {
+        fclose(file);
+        return;
+    }
+
+    // Heaps only for the buckets that occur: a single far-off date would
+    // otherwise span millions of empty hours.
+    int *buckets = (int *)malloc(count * sizeof(int));
+    if (!buckets) {
+        perror("Memory allocation failed");
+        fclose(file);
+        return;
+    }
+    for (long long i = 0; i < count; i++) {
+        buckets[i] = key_bucket(results[i].key);
+    }
+    qsort(buckets, count, sizeof(int), compare_buckets);
+    // Each heap holds k entries, or the bucket's group count if smaller.
+    int *capacities = (int *)malloc(count * sizeof(int));
+    long long num_buckets = 0;
+    size_t total_capacity = 0;
+    for (long long i = 0; capacities && i < count; i++) {
+        if (num_buckets == 0 || buckets[i] != buckets[num_buckets - 1]) {
+            buckets[num_buckets] = buckets[i];
+            capacities[num_buckets++] = 0;
+        }
+        if (capacities[num_buckets - 1] < query->k) {
+            capacities[num_buckets - 1]++;
+            total_capacity++;
+        }
+    }
+
+    if (num_threads > count) {
+        num_threads = (int)count;
+    }
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    TopKThreadData *thread_data = (TopKThreadData *)malloc(num_threads * sizeof(TopKThreadData));
+    TopHeap *heaps = (TopHeap *)calloc((size_t)(num_threads + 1) * num_buckets, sizeof(TopHeap));
+    TopEntry *entries = (TopEntry *)malloc((num_threads + 1) * total_capacity * sizeof(TopEntry));
+    if (!capacities || !threads || !thread_data || !heaps || !entries) {
+        perror("Memory allocation failed");
+        free(buckets);
+        free(capacities);
+        free(threads);
+        free(thread_data);
+        free(heaps);
+        free(entries);
+        fclose(file);
+        return;
+    }
+    TopEntry *next_entry = entries;
+    for (long long i = 0; i < (num_threads + 1) * num_buckets; i++) {
+        heaps[i].entries = next_entry;
+        heaps[i].capacity = capacities[i % num_buckets];
+        next_entry += heaps[i].capacity;
+    }
+
+    long long per_thread = count / num_threads;
+    long long remaining = count % num_threads;
+    long long start = 0;
+    for (int i = 0; i < num_threads; i++) {
+        thread_data[i].results = results;
+        thread_data[i].start = start;
+        thread_data[i].end = start + per_thread + (i < remaining ? 1 : 0);
+        thread_data[i].query = query;
+        thread_data[i].buckets = buckets;
+        thread_data[i].num_buckets = num_buckets;
+        thread_data[i].heaps = &heaps[(size_t)i * num_buckets];
+        start = thread_data[i].end;
+        pthread_create(&threads[i], NULL, top_k_worker, &thread_data[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    TopHeap *merged = &heaps[(size_t)num_threads * num_buckets];
+    for (long long m = 0; m < num_buckets; m++) {
+        for (int t = 0; t < num_threads; t++) {
+            const TopHeap *heap = &heaps[(size_t)t * num_buckets + m];
+            for (int j = 0; j < heap->size; j++) {
+                top_heap_push(&merged[m], heap->entries[j]);
+            }
+        }
+
+        // Popping the min-heap yields the weakest first, so fill from the back.
+        int n = merged[m].size;
+        TopEntry *ranked = merged[m].entries;
+        while (merged[m].size > 1) {
+            TopEntry weakest = ranked[0];
+            ranked[0] = ranked[--merged[m].size];
+            top_heap_sift_down(&merged[m], 0);
+            ranked[merged[m].size] = weakest;
+        }
+
+        for (int j = 0; j < n; j++) {
+            const MonthlyStats *stats = &results[ranked[j].index];
+            print_key(file, spec, dict, stats->key, KEY_TIME);
+            fprintf(file, "%d;", j + 1);
+            print_key(file, spec, dict, stats->key, ~KEY_TIME);
+            fprintf(file, "%s;%s;%.2f\n",
+                    sensor_names[query->sensor],
+                    stat_names[query->stat],
+                    query->ascending ? -ranked[j].key : ranked[j].key);
+        }
+    }
+
+    free(buckets);
+    free(capacities);
+    free(threads);
+    free(thread_data);
+    free(heaps);
+    free(entries);
+    fclose(file);
+}
+
+// Parses "sensor:stat" with stat one of max, avg or min.
+static int parse_top_k_option(const char *spec, TopKQuery *query) {
+    const char *colon = strchr(spec, ':');
+    if (!colon) {
+        return 0;
+    }
+
+    query->sensor = -1;
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        if (strlen(sensor_names[i]) == (size_t)(colon - spec) &&
+            strncmp(sensor_names[i], spec, colon - spec) == 0) {
+            query->sensor = i;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(colon + 1, stat_options[i]) == 0) {
+            query->stat = (StatKind)i;
+            return query->sensor >= 0;
+        }
+    }
+    return 0;
+}
+
+// Parses a comma-separated list such as "device,month" or "geo:0.01,day".
+// Time parts are year, month, day and hour; geo takes an optional tile size
+// in degrees (default 0.01); meta:NAME groups by a metadata attribute.
+static int parse_group_by_option(const char *text, GroupSpec *spec) {
+    static const char *buckets[] = {"", "year", "month", "day", "hour"};
+    char part[32];
+
+    spec->parts = 0;
+    spec->bucket = BUCKET_NONE;
+    spec->geo_cell = 0.01;
+    spec->meta_attr[0] = '\0';
+
+    while (*text) {
+        size_t len = strcspn(text, ",");
+        if (len == 0 || len >= sizeof(part)) {
+            return 0;
+        }
+        memcpy(part, text, len);
+        part[len] = '\0';
+        text += len + (text[len] == ',');
+
+        if (strcmp(part, "device") == 0) {
+            spec->parts |= KEY_DEVICE;
+        } else if (strncmp(part, "meta:", 5) == 0 && part[5] != '\0') {
+            strncpy(spec->meta_attr, part + 5, DEVICE_NAME_LENGTH - 1);
+            spec->parts |= KEY_META;
+        } else if (strncmp(part, "geo", 3) == 0 && (part[3] == '\0' || part[3] == ':')) {
+            if (part[3] == ':') {
+                char *end;
+                spec->geo_cell = strtod(part + 4, &end);
+                // 24 bits per tile index must cover 360 degrees of longitude.
+                if (*end != '\0' || !(spec->geo_cell >= 360.0 / 0xFFFFFF)) {
+                    return 0;
+                }
+            }
+            spec->parts |= KEY_GEO;
+        } else {
+            int found = 0;
+            for (int i = BUCKET_YEAR; i <= BUCKET_HOUR; i++) {
+                if (strcmp(part, buckets[i]) == 0 && spec->bucket == BUCKET_NONE) {
+                    spec->bucket = (TimeBucket)i;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                return 0;
+            }
+            spec->parts |= KEY_TIME;
+        }
+    }
+    return 1;
+}
+
+// Converts a leading "YYYY-MM-DD" to YYYYMMDD, or 0 if it is not a date.
+static int date_key(const char *date, size_t len) {
+    if (len < 10) {
+        return 0;
+    }
+    for (int i = 0; i < 10; i++) {
+        if (i == 4 || i == 7 ? date[i] != '-' : !isdigit((unsigned char)date[i])) {
+            return 0;
+        }
+    }
+    int year = (date[0] - '0') * 1000 + (date[1] - '0') * 100 + (date[2] - '0') * 10 + (date[3] - '0');
+    int month = (date[5] - '0') * 10 + (date[6] - '0');
+    int day = (date[8] - '0') * 10 + (date[9] - '0');
+    if (month < 1 || month > 12 || day < 1 || day > 31) {
+        return 0;
+    }
+    return year * 10000 + month * 100 + day;
+}
+
+// Seconds since midnight of a "YYYY-MM-DD HH:MM[:SS]" timestamp, 0 when the
+// time part is missing.
+static int time_of_day(const char *timestamp, size_t len) {
+    const char *t = timestamp + 11;
+    if (len < 16 || (timestamp[10] != ' ' && timestamp[10] != 'T')) {
+        return 0;
+    }
+    if (!isdigit((unsigned char)t[0]) || !isdigit((unsigned char)t[1]) || t[2] != ':' ||
+        !isdigit((unsigned char)t[3]) || !isdigit((unsigned char)t[4])) {
+        return 0;
+    }
+    int seconds = ((t[0] - '0') * 10 + (t[1] - '0')) * 3600 + ((t[3] - '0') * 10 + (t[4] - '0')) * 60;
+    if (len >= 19 && t[5] == ':' && isdigit((unsigned char)t[6]) && isdigit((unsigned char)t[7])) {
+        seconds += (t[6] - '0') * 10 + (t[7] - '0');
+    }
+    return seconds < 86400 ? seconds : 0;
+}
+
+typedef struct {
+    const char *text;
+    const char *pos;
+    FilterProgram *prog;
+    int depth;
+} FilterParser;
+
+static void filter_skip_spaces(FilterParser *p) {
+    while (isspace((unsigned char)*p->pos)) {
+        p->pos++;
+    }
+}
+
+// Consumes `word` if it is next in the input, as a whole word for keywords.
+static int filter_accept(FilterParser *p, const char *word) {
+    size_t len = strlen(word);
+    filter_skip_spaces(p);
+    if (strncmp(p->pos, word, len) != 0) {
+        return 0;
+    }
+    if (isalpha((unsigned char)word[0]) &&
+        (isalnum((unsigned char)p->pos[len]) || p->pos[len] == '_')) {
+        return 0;
+    }
+    p->pos += len;
+    return 1;
+}
+
+static int filter_error(FilterParser *p, const char *message) {
+    fprintf(stderr, "Filter error at column %d: %s\n", (int)(p->pos - p->text) + 1, message);
+    return 0;
+}
+
+static int filter_emit(FilterParser *p, FilterInstr *instr) {
+    if (p->prog->length == MAX_FILTER_INSTRS) {
+        return filter_error(p, "expression too long");
+    }
+    if (instr->opcode == FILTER_AND || instr->opcode == FILTER_OR) {
+        p->depth--;
+    } else if (instr->opcode != FILTER_NOT && ++p->depth > MAX_FILTER_DEPTH) {
+        return filter_error(p, "expression nested too deeply");
+    }
+    p->prog->code[p->prog->length++] = *instr;
+    return 1;
+}
+
+// Reads a quoted string or a bare word up to whitespace or ')'.
+static int filter_read_value(FilterParser *p, char *out, size_t size) {
+    size_t len = 0;
+    filter_skip_spaces(p);
+    if (*p->pos == '"') {
+        p->pos++;
+        while (*p->pos && *p->pos != '"') {
+            if (len + 1 < size) out[len++] = *p->pos;
+            p->pos++;
+        }
+        if (*p->pos != '"') {
+            return filter_error(p, "unterminated string");
+        }
+        p->pos++;
+    } else {
+        while (*p->pos && !isspace((unsigned char)*p->pos) && *p->pos != ')') {
+            if (len + 1 < size) out[len++] = *p->pos;
+            p->pos++;
+        }
+        if (len == 0) {
+            return filter_error(p, "expected a value");
+        }
+    }
+    out[len] = '\0';
+    return 1;
+}
+
+static int filter_read_compare(FilterParser *p, CompareOp *cmp) {
+    static const struct { const char *text; CompareOp cmp; } ops[] = {
+        {"<=", CMP_LE}, {">=", CMP_GE}, {"!=", CMP_NE}, {"<", CMP_LT}, {">", CMP_GT}, {"=", CMP_EQ}
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (filter_accept(p, ops[i].text)) {
+            *cmp = ops[i].cmp;
+            return 1;
+        }
+    }
+    return filter_error(p, "expected a comparison operator");
+}
+
+static int filter_parse_expr(FilterParser *p);
+
+static int filter_parse_compare(FilterParser *p) {
+    FilterInstr instr;
+    char value[64];
+    memset(&instr, 0, sizeof(instr));
+
+    if (filter_accept(p, "date")) {
+        if (!filter_read_compare(p, &instr.cmp) || !filter_read_value(p, value, sizeof(value))) {
+            return 0;
+        }
+        char padded[11];
+        size_t len = strlen(value);
+        if (len == 7) {
+            snprintf(padded, sizeof(padded), "%s-01", value);
+            instr.date_divisor = 100;
+        } else if (len == 10) {
+            memcpy(padded, value, 11);
+            instr.date_divisor = 1;
+        } else {
+            return filter_error(p, "expected a date as YYYY-MM or YYYY-MM-DD");
+        }
+        int key = date_key(padded, 10);
+        if (key == 0) {
+            return filter_error(p, "expected a date as YYYY-MM or YYYY-MM-DD");
+        }
+        instr.opcode = FILTER_DATE;
+        instr.value = key / instr.date_divisor;
+        return filter_emit(p, &instr);
+    }
+
+    if (filter_accept(p, "device")) {
+        if (filter_accept(p, "^=")) {
+            instr.opcode = FILTER_DEVICE_PREFIX;
+        } else if (filter_accept(p, "~")) {
+            instr.opcode = FILTER_DEVICE_REGEX;
+        } else if (filter_accept(p, "!=")) {
+            instr.opcode = FILTER_DEVICE_EQ;
+            instr.cmp = CMP_NE;
+        } else if (filter_accept(p, "=")) {
+            instr.opcode = FILTER_DEVICE_EQ;
+            instr.cmp = CMP_EQ;
+        } else {
+            return filter_error(p, "expected =, !=, ^= or ~ after device");
+        }
+        if (!filter_read_value(p, instr.text, sizeof(instr.text))) {
+            return 0;
+        }
+        if (instr.opcode == FILTER_DEVICE_REGEX) {
+#ifdef HAVE_REGEX
+            instr.regex = (regex_t *)malloc(sizeof(regex_t));
+            if (!instr.regex || regcomp(instr.regex, instr.text, REG_EXTENDED | REG_NOSUB) != 0) {
+                free(instr.regex);
+                return filter_error(p, "invalid regular expression");
+            }
+            if (!filter_emit(p, &instr)) {
+                regfree(instr.regex);
+                free(instr.regex);
+                return 0;
+            }
+            return 1;
+#else
+            return filter_error(p, "regular expressions are not supported on this platform");
+#endif
+        }
+        return filter_emit(p, &instr);
+    }
+
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        if (filter_accept(p, sensor_names[i])) {
+            char *end;
+            if (!filter_read_compare(p, &instr.cmp) || !filter_read_value(p, value, sizeof(value))) {
+                return 0;
+            }
+            instr.value = strtod(value, &end);
+            if (*end != '\0') {
+                return filter_error(p, "expected a number");
+            }
+            instr.opcode = FILTER_SENSOR;
+            instr.sensor = i;
+            return filter_emit(p, &instr);
+        }
+    }
+
+    return filter_error(p, "expected date, device or a sensor name");
+}
+
+static int filter_parse_unary(FilterParser *p) {
+    if (filter_accept(p, "not") || filter_accept(p, "!")) {
+        FilterInstr instr = {0};
+        instr.opcode = FILTER_NOT;
+        return filter_parse_unary(p) && filter_emit(p, &instr);
+    }
+    if (filter_accept(p, "(")) {
+        if (!filter_parse_expr(p)) {
+            return 0;
+        }
+        return filter_accept(p, ")") ? 1 : filter_error(p, "expected ')'");
+    }
+    return filter_parse_compare(p);
+}
+
+static int filter_parse_and(FilterParser *p) {
+    if (!filter_parse_unary(p)) {
+        return 0;
+    }
+    while (filter_accept(p, "and") || filter_accept(p, "&&")) {
+        FilterInstr instr = {0};
+        instr.opcode = FILTER_AND;
+        if (!filter_parse_unary(p) || !filter_emit(p, &instr)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int filter_parse_expr(FilterParser *p) {
+    if (!filter_parse_and(p)) {
+        return 0;
+    }
+    while (filter_accept(p, "or") || filter_accept(p, "||")) {
+        FilterInstr instr = {0};
+        instr.opcode = FILTER_OR;
+        if (!filter_parse_and(p) || !filter_emit(p, &instr)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void filter_free(FilterProgram *prog) {
+    for (int i = 0; i < prog->length; i++) {
+#ifdef HAVE_REGEX
+        if (prog->code[i].opcode == FILTER_DEVICE_REGEX) {
+            regfree(prog->code[i].regex);
+            free(prog->code[i].regex);
+        }
+#endif
+        free(prog->code[i].device_match);
+    }
+    prog->length = 0;
+}
+
+// Compiles e.g. `date >= 2024-03 and (device ^= sirros or eco2 > 1000)`.
+// An empty expression selects every record.
+static int filter_compile(FilterProgram *prog, const char *text) {
+    FilterParser p = {text, text, prog, 0};
+    prog->length = 0;
+
+    filter_skip_spaces(&p);
+    if (*p.pos == '\0') {
+        return 1;
+    }
+    if (!filter_parse_expr(&p)) {
+        filter_free(prog);
+        return 0;
+    }
+    filter_skip_spaces(&p);
+    if (*p.pos != '\0') {
+        filter_error(&p, "unexpected input");
+        filter_free(prog);
+        return 0;
+    }
+    return 1;
+}
+
+#define COMPARE_COLUMN(column, n, cmp, value, out)                      \
+    switch (cmp) {                                                      \
+        case CMP_LT: for (int j = 0; j < (n); j++) (out)[j] = (column)[j] < (value); break;  \
+        case CMP_LE: for (int j = 0; j < (n); j++) (out)[j] = (column)[j] <= (value); break; \
+        case CMP_GT: for (int j = 0; j < (n); j++) (out)[j] = (column)[j] > (value); break;  \
+        case CMP_GE: for (int j = 0; j < (n); j++) (out)[j] = (column)[j] >= (value); break; \
+        case CMP_EQ: for (int j = 0; j < (n); j++) (out)[j] = (column)[j] == (value); break; \
+        case CMP_NE: for (int j = 0; j < (n); j++) (out)[j] = (column)[j] != (value); break; \
+    }
+
+// Device predicates only depend on the name, so they are evaluated once per
+// dictionary entry; rows then just look their device id up. Call this after
+// new devices were interned and before filter_select sees them.
+static int filter_prepare_devices(FilterProgram *prog, const DeviceDict *dict) {
+    for (int i = 0; i < prog->length; i++) {
+        FilterInstr *instr = &prog->code[i];
+        if (instr->opcode != FILTER_DEVICE_EQ && instr->opcode != FILTER_DEVICE_PREFIX &&
+            instr->opcode != FILTER_DEVICE_REGEX) {
+            continue;
+        }
+        if (instr->device_match_count == dict->count) {
+            continue;
+        }
+
+        unsigned char *match = (unsigned char *)realloc(instr->device_match, dict->count > 0 ? dict->count : 1);
+        if (!match) {
+            return 0;
+        }
+        instr->device_match = match;
+        for (int id = instr->device_match_count; id < dict->count; id++) {
+            const char *name = dict->names[id];
+            switch (instr->opcode) {
+                case FILTER_DEVICE_EQ:
+                    match[id] = (strcmp(name, instr->text) == 0) == (instr->cmp == CMP_EQ);
+                    break;
+                case FILTER_DEVICE_PREFIX:
+                    match[id] = strncmp(name, instr->text, strlen(instr->text)) == 0;
+                    break;
+                default:
+#ifdef HAVE_REGEX
+                    match[id] = regexec(instr->regex, name, 0, NULL, 0) == 0;
+#endif
+                    break;
+            }
+        }
+        instr->device_match_count = dict->count;
+    }
+    return 1;
+}
+
+// Runs the program over up to FILTER_BATCH records and writes the indices
+// of the matching ones to `selection`. Returns how many matched.
+static int filter_select(const FilterProgram *prog, const SensorRecord *records, int n, int *selection) {
+    unsigned char stack[MAX_FILTER_DEPTH][FILTER_BATCH];
+    double column[FILTER_BATCH];
+    int top = -1;
+
+    if (prog->length == 0) {
+        for (int j = 0; j < n; j++) {
+            selection[j] = j;
+        }
+        return n;
+    }
+
+    for (int i = 0; i < prog->length; i++) {
+        const FilterInstr *instr = &prog->code[i];
+        unsigned char *out = stack[top + 1];
+
+        switch (instr->opcode) {
+            case FILTER_DATE: {
+                int value = (int)instr->value;
+                int divisor = instr->date_divisor;
+                for (int j = 0; j < n; j++) {
+                    column[j] = records[j].date / divisor;
+                }
+                COMPARE_COLUMN(column, n, instr->cmp, value, out);
+                for (int j = 0; j < n; j++) {
+                    out[j] &= records[j].date != 0;
+                }
+                top++;
+                break;
+            }
+            case FILTER_SENSOR: {
+                int sensor = instr->sensor;
+                for (int j = 0; j < n; j++) {
+                    column[j] = records[j].values[sensor];
+                }
+                COMPARE_COLUMN(column, n, instr->cmp, instr->value, out);
+                for (int j = 0; j < n; j++) {
+                    out[j] &= (records[j].valid >> sensor) & 1;
+                }
+                top++;
+                break;
+            }
+            case FILTER_DEVICE_EQ:
+            case FILTER_DEVICE_PREFIX:
+            case FILTER_DEVICE_REGEX:
+                for (int j = 0; j < n; j++) {
+                    out[j] = instr->device_match[records[j].device_id];
+                }
+                top++;
+                break;
+            case FILTER_AND:
+                for (int j = 0; j < n; j++) {
+                    stack[top - 1][j] &= stack[top][j];
+                }
+                top--;
+                break;
+            case FILTER_OR:
+                for (int j = 0; j < n; j++) {
+                    stack[top - 1][j] |= stack[top][j];
+                }
+                top--;
+                break;
+            case FILTER_NOT:
+                for (int j = 0; j < n; j++) {
+                    stack[top][j] ^= 1;
+                }
+                break;
+        }
+    }
+
+    int selected = 0;
+    for (int j = 0; j < n; j++) {
+        selection[selected] = j;
+        selected += stack[0][j];
+    }
+    return selected;
+}
+
+// Filters a freshly parsed batch in place and returns how many records it
+// kept at the front of the batch.
+static int keep_selected(const FilterProgram *filter, SensorRecord *batch, int n,
+                         long long *min_id, long long *max_id) {
+    int selection[FILTER_BATCH];
+    int selected = filter_select(filter, batch, n, selection);
+
+    for (int j = 0; j < selected; j++) {
+        if (selection[j] != j) {
+            batch[j] = batch[selection[j]];
+        }
+        if (batch[j].id >= 0) {
+            if (*max_id < *min_id || batch[j].id < *min_id) {
+                *min_id = batch[j].id;
+            }
+            if (batch[j].id > *max_id) {
+                *max_id = batch[j].id;
+            }
+        }
+    }
+    return selected;
+}
+
+static void device_meta_free(DeviceMeta *meta) {
+    device_dict_free(&meta->index);
+    device_dict_free(&meta->key_values);
+    free(meta->values);
+    free(meta->row_of_device);
+    free(meta->key_of_device);
+    memset(meta, 0, sizeof(*meta));
+}
+
+// Loads a '|'-separated table whose first column is the device name and
+// whose other columns (named by the header) are attributes of the device.
+static int load_device_meta(const char *filename, DeviceMeta *meta) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("Failed to open metadata file");
+        return 0;
+    }
+
+    char line[MAX_LINE_LENGTH];
+    memset(meta, 0, sizeof(*meta));
+    meta->key_attr = -1;
+    if (!device_dict_init(&meta->index) || !device_dict_init(&meta->key_values)) {
+        perror("Memory allocation failed");
+        device_meta_free(meta);
+        fclose(file);
+        return 0;
+    }
+
+    if (fgets(line, sizeof(line), file)) {
+        char *cursor = line;
+        line[strcspn(line, "\r\n")] = '\0';
+        next_field(&cursor);
+        while (cursor != NULL && meta->num_attrs < MAX_META_ATTRS) {
+            char *name = next_field(&cursor);
+            strncpy(meta->attr_names[meta->num_attrs], name, DEVICE_NAME_LENGTH - 1);
+            meta->num_attrs++;
+        }
+    }
+
+    int capacity = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char *cursor = line;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+
+        int row = device_dict_intern(&meta->index, next_field(&cursor));
+        if (row >= capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            void *values = realloc(meta->values, capacity * sizeof(*meta->values));
+            if (!values) {
+                row = -1;
+            } else {
+                meta->values = (char (*)[MAX_META_ATTRS][DEVICE_NAME_LENGTH])values;
+            }
+        }
+        if (row < 0) {
+            perror("Memory allocation failed");
+            device_meta_free(meta);
+            fclose(file);
+            return 0;
+        }
+
+        // A repeated device keeps its last row.
+        memset(meta->values[row], 0, sizeof(meta->values[row]));
+        for (int i = 0; i < meta->num_attrs && cursor != NULL; i++) {
+            strncpy(meta->values[row][i], next_field(&cursor), DEVICE_NAME_LENGTH - 1);
+        }
+    }
+
+    fclose(file);
+    return 1;
+}
+
+// Joins the metadata to the devices seen in the data. Each device is looked
+// up once here, so per-row work is a single array index.
+static int device_meta_bind(DeviceMeta *meta, const DeviceDict *dict) {
+    int count = dict->count > 0 ? dict->count : 1;
+    meta->row_of_device = (int *)malloc(count * sizeof(int));
+    meta->key_of_device = (int *)malloc(count * sizeof(int));
+    if (!meta->row_of_device || !meta->key_of_device) {
+        return 0;
+    }
+
+    for (int id = 0; id < dict->count; id++) {
+        int row = device_dict_find(&meta->index, dict->names[id]);
+        meta->row_of_device[id] = row;
+        meta->key_of_device[id] = META_UNKNOWN;
+        if (row >= 0 && meta->key_attr >= 0) {
+            int value = device_dict_intern(&meta->key_values, meta->values[row][meta->key_attr]);
+            if (value < 0) {
+                return 0;
+            }
+            if (value >= META_UNKNOWN) {
+                fprintf(stderr, "Too many distinct values of %s\n", meta->attr_names[meta->key_attr]);
+                return 0;
+            }
+            meta->key_of_device[id] = value;
+        }
+    }
+    return 1;
+}
+
+typedef enum {
+    ROW_OK,
+    ROW_BLANK,
+    ROW_MALFORMED,             // fewer than NUM_FIELDS fields
+    ROW_CORRUPT,               // contains NUL bytes
+    ROW_OVERLONG,              // a field longer than its limit
+    ROW_NO_MEMORY
+} RowStatus;
+
+static const char *row_status_names[] = {"", "", "campos_faltando", "corrompida", "longa_demais", ""};
+
+typedef struct {
+    long long malformed;
+    long long corrupt;
+    long long overlong;
+    int unsaved;               // some rejected rows could not be written out
+} RowErrors;
+
+// Finds the end of the line at `line` and its separators in one pass. The
+// vector versions compare a whole register of bytes against '|', '\n' and
+// NUL at once, so validating a row costs nothing beyond finding its fields.
+// Each ends in this scalar tail for the last partial register.
+static void scan_line_tail(const char *p, const char *end, LineScan *scan) {
+    const char *newline_at = (const char *)memchr(p, '\n', (size_t)(end - p));
+    scan->end = newline_at ? newline_at : end;
+    scan->has_nul |= memchr(p, '\0', (size_t)(scan->end - p)) != NULL;
+    while (scan->num_seps < NUM_FIELDS &&
+           (p = (const char *)memchr(p, '|', (size_t)(scan->end - p))) != NULL) {
+        scan->seps[scan->num_seps++] = p++;
+    }
+}
+
+static void scan_line_scalar(const char *line, const char *end, LineScan *scan) {
+    scan->num_seps = 0;
+    scan->has_nul = 0;
+    scan_line_tail(line, end, scan);
+}
+
+// Records the separators in `seps` (bit i is p[i]) until NUM_FIELDS are known.
+static inline void add_separators(LineScan *scan, const char *p, unsigned long long seps) {
+    while (seps && scan->num_seps < NUM_FIELDS) {
+        scan->seps[scan->num_seps++] = p + __builtin_ctzll(seps);
+        seps &= seps - 1;
+    }
+}
+
+#ifdef HAVE_SSE2
+static void scan_line_sse2(const char *line, const char *end, LineScan *scan) {
+    const __m128i pipe = _mm_set1_epi8('|');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    const char *p = line;
+    scan->num_seps = 0;
+    scan->has_nul = 0;
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        unsigned int seps = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pipe));
+        unsigned int newlines = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        unsigned int nuls = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+        unsigned int before_end = newlines ? (1u << __builtin_ctz(newlines)) - 1 : 0xFFFFu;
+
+        scan->has_nul |= (nuls & before_end) != 0;
+        add_separators(scan, p, seps & before_end);
+        if (newlines) {
+            scan->end = p + __builtin_ctz(newlines);
+            return;
+        }
+    }
+    scan_line_tail(p, end, scan);
+}
+#endif
+
+#ifdef HAVE_X86_DISPATCH
+__attribute__((target("avx2")))
+static void scan_line_avx2(const char *line, const char *end, LineScan *scan) {
+    const __m256i pipe = _mm256_set1_epi8('|');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    const char *p = line;
+    scan->num_seps = 0;
+    scan->has_nul = 0;
+
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int seps = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pipe));
+        unsigned int newlines = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        unsigned int nuls = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, zero));
+        unsigned int before_end = newlines ? (1u << __builtin_ctz(newlines)) - 1 : 0xFFFFFFFFu;
+
+        scan->has_nul |= (nuls & before_end) != 0;
+        add_separators(scan, p, seps & before_end);
+        if (newlines) {
+            scan->end = p + __builtin_ctz(newlines);
+            return;
+        }
+    }
+    scan_line_tail(p, end, scan);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void scan_line_avx512(const char *line, const char *end, LineScan *scan) {
+    const __m512i pipe = _mm512_set1_epi8('|');
+    const __m512i newline = _mm512_set1_epi8('\n');
+    const __m512i zero = _mm512_setzero_si512();
+    const char *p = line;
+    scan->num_seps = 0;
+    scan->has_nul = 0;
+
+    for (; end - p >= 64; p += 64) {
+        __m512i chunk = _mm512_loadu_si512((const void *)p);
+        unsigned long long seps = _mm512_cmpeq_epi8_mask(chunk, pipe);
+        unsigned long long newlines = _mm512_cmpeq_epi8_mask(chunk, newline);
+        unsigned long long nuls = _mm512_cmpeq_epi8_mask(chunk, zero);
+        unsigned long long before_end = newlines ? (1ULL << __builtin_ctzll(newlines)) - 1 : ~0ULL;
+
+        scan->has_nul |= (nuls & before_end) != 0;
+        add_separators(scan, p, seps & before_end);
+        if (newlines) {
+            scan->end = p + __builtin_ctzll(newlines);
+            return;
+        }
+    }
+    scan_line_tail(p, end, scan);
+}
+#endif
+
+typedef enum {
+    ISA_SCALAR,
+    ISA_SSE2,
+    ISA_AVX2,
+    ISA_AVX512
+} IsaLevel;
+
+// Every variant built into this binary, from the most portable. Plain
+// decimals are too short for a vector parser to pay off, so all of them
+// share the scalar float parser.
+static const struct {
+    IsaLevel isa;
+    KernelSet set;
+} kernel_variants[] = {
+    {ISA_SCALAR, {"scalar", scan_line_scalar, parse_sensor_value, process_record_scalar, update_run_scalar}},
+#ifdef HAVE_SSE2
+    {ISA_SSE2, {"sse2", scan_line_sse2, parse_sensor_value, process_record_sse2, update_run_sse2}},
+#endif
+#ifdef HAVE_X86_DISPATCH
+    {ISA_AVX2, {"avx2", scan_line_avx2, parse_sensor_value, process_record_avx2, update_run_avx2}},
+    {ISA_AVX512, {"avx512", scan_line_avx512, parse_sensor_value, process_record_avx512, update_run_avx512}},
+#endif
+};
+
+static int cpu_supports(IsaLevel isa) {
+#ifdef HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    switch (isa) {
+        case ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case ISA_AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+        default:
+            return 1;
+    }
+#else
+    (void)isa;
+    return 1;
+#endif
+}
+
+// Looks up the named variant, or the best one the CPU supports when `name`
+// is NULL.
+static int select_kernels(const char *name, KernelSet *set) {
+    int count = (int)(sizeof(kernel_variants) / sizeof(kernel_variants[0]));
+    int chosen = -1;
+
+    for (int i = 0; i < count; i++) {
+        if (name && strcmp(kernel_variants[i].set.name, name) != 0) {
+            continue;
+        }
+        if (!cpu_supports(kernel_variants[i].isa)) {
+            if (name) {
+                fprintf(stderr, "Instruction set '%s' is not supported by this CPU\n", name);
+                return 0;
+            }
+            continue;
+        }
+        chosen = i;
+    }
+    if (chosen < 0) {
+        fprintf(stderr, "Unknown instruction set '%s', expected one of:", name);
+        for (int i = 0; i < count; i++) {
+            fprintf(stderr, " %s", kernel_variants[i].set.name);
+        }
+        fprintf(stderr, "\n");
+        return 0;
+    }
+    *set = kernel_variants[chosen].set;
+    return 1;
+}
+
+// The kernels and the valid ranges are fixed by the first analyzer or report
+// and never change afterwards, so workers read them without locking.
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+static int engine_bound;
+
+// Binds `kernels` once. Later calls succeed when `name` is NULL or names the
+// variant already bound.
+static int bind_kernels(const char *name) {
+    int ok = 1;
+    pthread_mutex_lock(&engine_lock);
+    if (!engine_bound) {
+        ok = select_kernels(name, &kernels);
+        engine_bound = ok;
+    } else if (name && strcmp(name, kernels.name) != 0) {
+        fprintf(stderr, "Kernels are already bound to '%s'\n", kernels.name);
+        ok = 0;
+    }
+    pthread_mutex_unlock(&engine_lock);
+    return ok;
+}
+
+// Parses the scanned line at `line` into `record`.
+static RowStatus parse_line(const char *line, const LineScan *scan, SensorRecord *record, DeviceDict *dict) {
+    const char *end = scan->end;
+    int has_latitude = 0;
+
+    if (end > line && end[-1] == '\r') {
+        end--;
+    }
+    if (end == line) {
+        return ROW_BLANK;
+    }
+    if (scan->has_nul) {
+        return ROW_CORRUPT;
+    }
+    if (scan->num_seps < NUM_FIELDS - 1) {
+        return ROW_MALFORMED;
+    }
+    memset(record, 0, sizeof(*record));
+    record->id = -1;
+    record->seq = -1;
+
+    const char *cursor = line;
+    for (int field = 0; field < NUM_FIELDS; field++) {
+        const char *token_end = field < scan->num_seps ? scan->seps[field] : end;
+        size_t len = (size_t)(token_end - cursor);
+        if (len > (field == 1 ? DEVICE_NAME_LENGTH - 1 : MAX_FIELD_LENGTH)) {
+            return ROW_OVERLONG;
+        }
+
+        switch (field) {
+            case 0: // id
+                record->id = parse_counter(cursor, token_end);
+                break;
+            case 1: // device
+                record->device_id = device_dict_intern_bytes(dict, cursor, len);
+                if (record->device_id < 0) {
+                    return ROW_NO_MEMORY;
+                }
+                break;
+            case 2: // contagem
+                record->seq = parse_counter(cursor, token_end);
+                break;
+            case 3: // data
+                record->date = date_key(cursor, len);
+                record->time = record->date ? time_of_day(cursor, len) : 0;
+                break;
+            case 4: // temperatura
+            case 5: // umidade
+            case 6: // luminosidade
+            case 7: // ruido
+            case 8: // eco2
+            case 9: // etvoc
+                if (kernels.parse_value(cursor, token_end, &record->values[field - 4])) {
+                    record->valid |= (unsigned char)(1u << (field - 4));
+                }
+                break;
+            case 10: // latitude
+                has_latitude = kernels.parse_value(cursor, token_end, &record->latitude);
+                break;
+            case 11: // longitude
+                if (has_latitude && kernels.parse_value(cursor, token_end, &record->longitude)) {
+                    record->valid |= VALID_GEO;
+                }
+                break;
+        }
+
+        cursor = token_end + 1;
+    }
+    return ROW_OK;
+}
+
+// Rejected lines of one parsing thread, buffered and appended to the
+// rejects file in large writes. The file is only created once a row is
+// rejected.
+typedef struct {
+    const char *filename;
+    FILE *file;
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;                // could not write; rows are still counted
+} Quarantine;
+
+static void quarantine_flush(Quarantine *quarantine) {
+    if (quarantine->length == 0 || quarantine->failed) {
+        quarantine->length = 0;
+        return;
+    }
+    if (!quarantine->file) {
+        quarantine->file = fopen(quarantine->filename, "wb");
+        if (!quarantine->file) {
+            perror("Failed to open rejects file");
+            quarantine->failed = 1;
+            quarantine->length = 0;
+            return;
+        }
+        fprintf(quarantine->file, "deslocamento;motivo;linha\n");
+    }
+    if (fwrite(quarantine->data, 1, quarantine->length, quarantine->file) != quarantine->length) {
+        perror("Failed to write rejects file");
+        quarantine->failed = 1;
+    }
+    quarantine->length = 0;
+}
+
+// Buffers the raw line in [line, end) with its byte offset and the reason.
+static void quarantine_add(Quarantine *quarantine, long long offset, RowStatus reason,
+                           const char *line, const char *end) {
+    char prefix[64];
+    int prefix_length = snprintf(prefix, sizeof(prefix), "%lld;%s;", offset, row_status_names[reason]);
+    size_t needed = (size_t)prefix_length + (size_t)(end - line) + 1;
+
+    if (quarantine->failed) {
+        return;
+    }
+    if (quarantine->length + needed > quarantine->capacity) {
+        quarantine_flush(quarantine);
+        if (needed > quarantine->capacity) {
+            size_t capacity = needed > QUARANTINE_FLUSH ? needed : QUARANTINE_FLUSH;
+            char *data = (char *)realloc(quarantine->data, capacity);
+            if (!data) {
+                perror("Memory allocation failed");
+                quarantine->failed = 1;
+                return;
+            }
+            quarantine->data = data;
+            quarantine->capacity = capacity;
+        }
+    }
+    memcpy(quarantine->data + quarantine->length, prefix, (size_t)prefix_length);
+    memcpy(quarantine->data + quarantine->length + prefix_length, line, (size_t)(end - line));
+    quarantine->length += needed;
+    quarantine->data[quarantine->length - 1] = '\n';
+}
+
+static void quarantine_close(Quarantine *quarantine) {
+    quarantine_flush(quarantine);
+    if (quarantine->file && (ferror(quarantine->file) | fclose(quarantine->file)) && !quarantine->failed) {
+        perror("Failed to write rejects file");
+        quarantine->failed = 1;
+    }
+    free(quarantine->data);
+    quarantine->file = NULL;
+    quarantine->data = NULL;
+}
+
+// Read-only view of a whole input file.
+typedef struct {
+    const char *data;
+    long long size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} MappedFile;
+
+static int map_file(const char *filename, MappedFile *mapped) {
+    mapped->data = NULL;
+    mapped->size = 0;
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    mapped->mapping = NULL;
+    mapped->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    if (GetFileSizeEx(mapped->file, &size) && size.QuadPart > 0) {
+        mapped->size = size.QuadPart;
+        mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapped->mapping) {
+            mapped->data = (const char *)MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+        if (!mapped->data) {
+            if (mapped->mapping) {
+                CloseHandle(mapped->mapping);
+            }
+            CloseHandle(mapped->file);
+            return 0;
+        }
+    }
+    return 1;
+#else
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return 0;
+    }
+    mapped->size = info.st_size;
+    if (mapped->size > 0) {
+        void *data = mmap(NULL, (size_t)mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        mapped->data = (const char *)data;
+    }
+    close(fd);
+    return 1;
+#endif
+}
+
+static void unmap_file(MappedFile *mapped) {
+#ifdef _WIN32
+    if (mapped->data) {
+        UnmapViewOfFile(mapped->data);
+        CloseHandle(mapped->mapping);
+    }
+    CloseHandle(mapped->file);
+#else
+    if (mapped->data) {
+        munmap((void *)mapped->data, (size_t)mapped->size);
+    }
+#endif
+    mapped->data = NULL;
+}
+
+// Where the readers collect records. Rows are parsed straight into the
+// array and filtered in batches, compacting the matches to the front.
+typedef struct {
+    FilterProgram *filter;
+    DeviceDict *dict;
+    SensorRecord *records;
+    long long capacity;
+    long long kept;
+    int batch;
+    long long parsed;
+    long long bytes_done;      // for status reports
+    long long min_id;
+    long long max_id;
+    RowErrors errors;
+    const char *base;          // start of the input, for reject offsets
+    Quarantine quarantine;
+} Loader;
+
+static int loader_flush(Loader *loader) {
+    if (!filter_prepare_devices(loader->filter, loader->dict)) {
+        return 0;
+    }
+    loader->kept += keep_selected(loader->filter, &loader->records[loader->kept], loader->batch,
+                                  &loader->min_id, &loader->max_id);
+    loader->batch = 0;
+    return 1;
+}
+
+// Parses the lines starting in [cursor, stop); the last one may run on to
+// `end`. Returns 0 when out of memory.
+static int load_lines(Loader *loader, const char *cursor, const char *stop, const char *end) {
+    const char *begin = cursor;
+
+    while (cursor < stop) {
+        LineScan scan;
+        kernels.scan_line(cursor, end, &scan);
+
+        if ((++loader->parsed & (FILTER_BATCH - 1)) == 0) {
+            atomic_store_explicit(&run_status.rows_parsed, loader->parsed, memory_order_relaxed);
+            atomic_store_explicit(&run_status.bytes_read, loader->bytes_done + (cursor - begin),
+                                  memory_order_relaxed);
+        }
+        if (loader->kept + loader->batch == loader->capacity) {
+            SensorRecord *grown = (SensorRecord *)realloc(loader->records,
+                                                          (size_t)(2 * loader->capacity) * sizeof(SensorRecord));
+            if (!grown) {
+                return 0;
+            }
+            loader->records = grown;
+            loader->capacity *= 2;
+        }
+
+        RowStatus status = parse_line(cursor, &scan, &loader->records[loader->kept + loader->batch], loader->dict);
+        switch (status) {
+            case ROW_OK:
+                if (++loader->batch == FILTER_BATCH && !loader_flush(loader)) {
+                    return 0;
+                }
+                break;
+            case ROW_BLANK:
+                break;
+            case ROW_MALFORMED:
+            case ROW_CORRUPT:
+            case ROW_OVERLONG:
+                if (status == ROW_MALFORMED) {
+                    loader->errors.malformed++;
+                } else if (status == ROW_CORRUPT) {
+                    loader->errors.corrupt++;
+                } else {
+                    loader->errors.overlong++;
+                }
+                quarantine_add(&loader->quarantine, cursor - loader->base, status, cursor, scan.end);
+                break;
+            case ROW_NO_MEMORY:
+                return 0;
+        }
+        cursor = scan.end < end ? scan.end + 1 : end;
+    }
+    loader->bytes_done += cursor - begin;
+    return 1;
+}
+
+static void loader_init(Loader *loader, FilterProgram *filter, DeviceDict *dict,
+                        const char *base, const char *rejects_filename) {
+    memset(loader, 0, sizeof(*loader));
+    loader->filter = filter;
+    loader->dict = dict;
+    loader->max_id = -1;
+    loader->base = base;
+    loader->quarantine.filename = rejects_filename;
+}
+
+// Hands the records to the caller, or frees them when `ok` is 0.
+static int loader_finish(Loader *loader, int ok, SensorRecord **records, long long *record_count,
+                         long long *min_id, long long *max_id, RowErrors *errors) {
+    if (ok) {
+        ok = loader_flush(loader);
+    }
+    quarantine_close(&loader->quarantine);
+    loader->errors.unsaved = loader->quarantine.failed;
+    if (!ok) {
+        perror("Memory allocation failed");
+        free(loader->records);
+        return 0;
+    }
+    *records = loader->records;
+    *record_count = loader->kept;
+    *min_id = loader->min_id;
+    *max_id = loader->max_id;
+    *errors = loader->errors;
+    return 1;
+}
+
+// Parses the whole file through a read-only mapping. Lines may be of any
+// length; a first pass counts them to size the record array.
+static int read_csv(const char *filename, FilterProgram *filter, DeviceDict *dict,
+                    SensorRecord **records, long long *record_count,
+                    long long *min_id, long long *max_id, RowErrors *errors, const char *rejects_filename) {
+    MappedFile mapped;
+    if (!map_file(filename, &mapped)) {
+        perror("Failed to open input file");
+        return 0;
+    }
+#ifdef POSIX_MADV_SEQUENTIAL
+    if (mapped.data) {
+        posix_madvise((void *)mapped.data, (size_t)mapped.size, POSIX_MADV_SEQUENTIAL);
+    }
+#endif
+
+    const char *end = mapped.data + mapped.size;
+    long long lines = 1;
+    atomic_store_explicit(&run_status.bytes_total, mapped.size, memory_order_relaxed);
+    atomic_store_explicit(&run_status.phase, PHASE_COUNTING, memory_order_relaxed);
+    for (const char *p = mapped.data; p < end; p++, lines++) {
+        p = (const char *)memchr(p, '\n', (size_t)(end - p));
+        if (!p) {
+            break;
+        }
+        if ((lines & 65535) == 0) {
+            atomic_store_explicit(&run_status.bytes_read, p - mapped.data, memory_order_relaxed);
+        }
+    }
+
+    Loader loader;
+    loader_init(&loader, filter, dict, mapped.data, rejects_filename);
+    loader.capacity = lines;
+    loader.records = (SensorRecord *)malloc((size_t)loader.capacity * sizeof(SensorRecord));
+    if (!loader.records) {
+        perror("Memory allocation failed");
+        unmap_file(&mapped);
+        return 0;
+    }
+
+    atomic_store_explicit(&run_status.bytes_read, 0, memory_order_relaxed);
+    atomic_store_explicit(&run_status.phase, PHASE_PARSING, memory_order_relaxed);
+    const char *body = mapped.data ? memchr(mapped.data, '\n', (size_t)mapped.size) : NULL;
+    int ok = body == NULL || load_lines(&loader, body + 1, end, end);
+
+    unmap_file(&mapped);
+    return loader_finish(&loader, ok, records, record_count, min_id, max_id, errors);
+}
+
+static double next_random(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Scrambles a seed into a nonzero xorshift state, so nearby seeds such as
+// consecutive pids still pick unrelated blocks.
+static unsigned long long mix_seed(unsigned long long seed) {
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    seed ^= seed >> 31;
+    return seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+// A different seed for every run, so repeated estimates are independent.
+static unsigned long long clock_seed(void) {
+    unsigned long long seed = (unsigned long long)time(NULL) * 1000003ULL ^
+                              (unsigned long long)(now_seconds() * 1e9);
+#ifdef _WIN32
+    seed ^= (unsigned long long)GetCurrentProcessId() << 40;
+#else
+    seed ^= (unsigned long long)getpid() << 40;
+#endif
+    return seed ? seed : 1;
+}
+
+// Reads only a random subset of SAMPLE_BLOCK_SIZE blocks of the file, chosen
+// by selection sampling so they are visited in file order. Skipped blocks are
+// never touched, so their pages are never read. A line belongs to the block
+// holding its first byte, and each record notes which sampled block that
+// is. The same `seed` picks the same blocks. `coverage` receives the
+// fraction of bytes read, so a short last block counts for what it holds,
+// and `sample` the number of blocks read and their fraction.
+static int read_csv_sampled(const char *filename, double fraction, unsigned long long seed,
+                            FilterProgram *filter, DeviceDict *dict, SensorRecord **records,
+                            long long *record_count, long long *min_id, long long *max_id, RowErrors *errors,
+                            const char *rejects_filename, double *coverage, BlockSample *sample) {
+    MappedFile mapped;
+    if (!map_file(filename, &mapped)) {
+        perror("Failed to open input file");
+        return 0;
+    }
+
+    long long num_blocks = (mapped.size + SAMPLE_BLOCK_SIZE - 1) / SAMPLE_BLOCK_SIZE;
+    long long wanted = (long long)ceil(fraction * num_blocks);
+    long long chosen = 0, bytes = 0;
+    unsigned long long rng = mix_seed(seed);
+    const char *end = mapped.data + mapped.size;
+
+    Loader loader;
+    loader_init(&loader, filter, dict, mapped.data, rejects_filename);
+    loader.capacity = FILTER_BATCH;
+    loader.records = (SensorRecord *)malloc((size_t)loader.capacity * sizeof(SensorRecord));
+    if (!loader.records) {
+        perror("Memory allocation failed");
+        unmap_file(&mapped);
+        return 0;
+    }
+
+    int ok = 1;
+    atomic_store_explicit(&run_status.bytes_total, wanted * SAMPLE_BLOCK_SIZE, memory_order_relaxed);
+    atomic_store_explicit(&run_status.phase, PHASE_PARSING, memory_order_relaxed);
+    for (long long block = 0; ok && block < num_blocks && chosen < wanted; block++) {
+        if ((num_blocks - block) * next_random(&rng) >= wanted - chosen) {
+            continue;
+        }
+
+        const char *start = mapped.data + block * SAMPLE_BLOCK_SIZE;
+        const char *stop = block + 1 < num_blocks ? start + SAMPLE_BLOCK_SIZE : end;
+        // From the byte before the block, this skips the tail of the line the
+        // previous block owns (or just its newline); at 0 it skips the header.
+        const char *first = block > 0 ? start - 1 : start;
+        first = (const char *)memchr(first, '\n', (size_t)(end - first));
+        // Flushed on both sides, the block's kept rows are the ones added.
+        long long kept = loader.kept;
+        if (first && first + 1 < stop) {
+            ok = load_lines(&loader, first + 1, stop, end) && loader_flush(&loader);
+        }
+        for (long long i = kept; ok && i < loader.kept; i++) {
+            loader.records[i].block = (int)chosen;
+        }
+        bytes += stop - start;
+        chosen++;
+    }
+    *coverage = mapped.size > 0 ? (double)bytes / mapped.size : 1.0;
+    sample->num_blocks = chosen;
+    sample->block_fraction = num_blocks > 0 ? (double)chosen / num_blocks : 1.0;
+
+    unmap_file(&mapped);
+    return loader_finish(&loader, ok, records, record_count, min_id, max_id, errors);
+}
+
+// Sorting by device and then time turns each device's readings into one
+// contiguous, chronological segment. The radix passes move (key, index)
+// pairs instead of whole records, which are gathered once at the end.
+#define SORT_TIME_BITS 40
+#define SORT_MAX_DEVICES (1 << (64 - SORT_TIME_BITS))
+#define SORT_EPOCH_DAYS (1 << 20)   // keeps days before 1970 positive
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+typedef struct {
+    unsigned long long key;    // device id above the seconds of the reading
+    long long index;           // position in the unsorted records
+} SortItem;
+
+typedef struct {
+    long long start;
+    long long count;
+} DeviceSegment;
+
+typedef enum {
+    RADIX_KEYS,
+    RADIX_COUNT,
+    RADIX_SCATTER,
+    RADIX_GATHER
+} RadixStep;
+
+typedef struct {
+    RadixStep step;
+    const SensorRecord *records;
+    SensorRecord *sorted;
+    SortItem *src;
+    SortItem *dst;
+    long long start;
+    long long end;
+    int shift;
+    long long buckets[RADIX_BUCKETS];   // digit counts, then scatter positions
+    unsigned long long key_or;
+    unsigned long long key_and;
+} RadixThreadData;
+
+static inline unsigned long long sort_key(const SensorRecord *record) {
+    unsigned long long seconds = 0;   // undated readings sort first
+    if (record->date > 0) {
+        int days = days_from_civil(record->date / 10000, record->date / 100 % 100, record->date % 100);
+        seconds = (unsigned long long)(days + SORT_EPOCH_DAYS) * 86400 + record->time;
+    }
+    return (unsigned long long)record->device_id << SORT_TIME_BITS | seconds;
+}
+
+static void *radix_worker(void *arg) {
+    RadixThreadData *data = (RadixThreadData *)arg;
+    int mask = RADIX_BUCKETS - 1;
+
+    switch (data->step) {
+        case RADIX_KEYS:
+            data->key_or = 0;
+            data->key_and = ~0ULL;
+            for (long long i = data->start; i < data->end; i++) {
+                unsigned long long key = sort_key(&data->records[i]);
+                data->src[i].key = key;
+                data->src[i].index = i;
+                data->key_or |= key;
+                data->key_and &= key;
+            }
+            break;
+        case RADIX_COUNT:
+            memset(data->buckets, 0, sizeof(data->buckets));
+            for (long long i = data->start; i < data->end; i++) {
+                data->buckets[(data->src[i].key >> data->shift) & mask]++;
+            }
+            break;
+        case RADIX_SCATTER:
+            for (long long i = data->start; i < data->end; i++) {
+                data->dst[data->buckets[(data->src[i].key >> data->shift) & mask]++] = data->src[i];
+            }
+            break;
+        case RADIX_GATHER:
+            for (long long i = data->start; i < data->end; i++) {
+                data->sorted[i] = data->records[data->src[i].index];
+            }
+            break;
+    }
+    return NULL;
+}
+
+static void run_radix_step(RadixThreadData *data, pthread_t *threads, int num_threads, RadixStep step) {
+    for (int t = 0; t < num_threads; t++) {
+        data[t].step = step;
+        pthread_create(&threads[t], NULL, radix_worker, &data[t]);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+// Stable LSD radix sort of the records on (device, timestamp), one byte per
+// pass. Passes over bytes that are equal in every key are skipped, so a
+// short time span or a handful of devices needs only a few. On success the
+// records are replaced by the sorted copy and segments[d] is where device
+// d starts and how many readings it has.
+static int sort_records_by_device(SensorRecord **records, long long count, int num_devices,
+                                  DeviceSegment **segments) {
+    if (num_devices > SORT_MAX_DEVICES) {
+        fprintf(stderr, "Too many devices to sort (%d, at most %d)\n", num_devices, SORT_MAX_DEVICES);
+        return 0;
+    }
+    int num_threads = get_cpu_count();
+    if (num_threads > count) {
+        num_threads = (int)count;
+    }
+
+    SortItem *items = (SortItem *)malloc(count * sizeof(SortItem));
+    SortItem *spare = (SortItem *)malloc(count * sizeof(SortItem));
+    SensorRecord *sorted = (SensorRecord *)malloc(count * sizeof(SensorRecord));
+    DeviceSegment *index = (DeviceSegment *)calloc(num_devices, sizeof(DeviceSegment));
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    RadixThreadData *data = (RadixThreadData *)malloc(num_threads * sizeof(RadixThreadData));
+    if (!items || !spare || !sorted || !index || !threads || !data) {
+        perror("Memory allocation failed");
+        free(items);
+        free(spare);
+        free(sorted);
+        free(index);
+        free(threads);
+        free(data);
+        return 0;
+    }
+
+    long long per_thread = count / num_threads;
+    long long remaining = count % num_threads;
+    long long start = 0;
+    for (int t = 0; t < num_threads; t++) {
+        data[t].records = *records;
+        data[t].sorted = sorted;
+        data[t].src = items;
+        data[t].start = start;
+        data[t].end = start + per_thread + (t < remaining ? 1 : 0);
+        start = data[t].end;
+    }
+    run_radix_step(data, threads, num_threads, RADIX_KEYS);
+
+    unsigned long long key_or = 0, key_and = ~0ULL;
+    for (int t = 0; t < num_threads; t++) {
+        key_or |= data[t].key_or;
+        key_and &= data[t].key_and;
+    }
+    unsigned long long varying = key_or & ~key_and;
+
+    for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+        if (((varying >> shift) & (RADIX_BUCKETS - 1)) == 0) {
+            continue;
+        }
+        for (int t = 0; t < num_threads; t++) {
+            data[t].src = items;
+            data[t].dst = spare;
+            data[t].shift = shift;
+        }
+        run_radix_step(data, threads, num_threads, RADIX_COUNT);
+
+        // Keys with digit d go after all smaller digits and after the keys
+        // with digit d from earlier threads, which keeps every pass stable.
+        long long offset = 0;
+        for (int d = 0; d < RADIX_BUCKETS; d++) {
+            for (int t = 0; t < num_threads; t++) {
+                long long n = data[t].buckets[d];
+                data[t].buckets[d] = offset;
+                offset += n;
+            }
+        }
+        run_radix_step(data, threads, num_threads, RADIX_SCATTER);
+
+        SortItem *swap = items;
+        items = spare;
+        spare = swap;
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        data[t].src = items;
+    }
+    run_radix_step(data, threads, num_threads, RADIX_GATHER);
+
+    for (long long i = 0; i < count; i++) {
+        DeviceSegment *segment = &index[sorted[i].device_id];
+        if (segment->count == 0) {
+            segment->start = i;
+        }
+        segment->count++;
+    }
+
+    free(*records);
+    *records = sorted;
+    *segments = index;
+    free(items);
+    free(spare);
+    free(threads);
+    free(data);
+    return 1;
+}
+
+// A segment store keeps ingested rows as immutable, columnar segment files,
+// one per month of readings, listed in a manifest. Ingesting only ever adds
+// segments, so old data is never rewritten or reparsed. Columns are stored
+// in the machine's native byte order and aligned to 8 bytes, so a mapped
+// segment is read in place.
+#define SEGMENT_MAGIC "IOTSEG01"
+#define MANIFEST_NAME "MANIFEST"
+#define LOCK_NAME "LOCK"             // held by an ingest while it runs
+#define PATH_LENGTH 1024
+#define SEGMENT_BLOCK 4096         // rows per independently decodable block
+
+typedef enum {
+    COLUMN_ID,
+    COLUMN_SEQ,
+    COLUMN_DEVICE,             // codes into the segment's device dictionary
+    COLUMN_DATE,
+    COLUMN_TIME,
+    COLUMN_VALUES,             // NUM_SENSORS columns, one per sensor
+    COLUMN_LATITUDE = COLUMN_VALUES + NUM_SENSORS,
+    COLUMN_LONGITUDE,
+    COLUMN_VALID,
+    COLUMN_DICTIONARY,         // device names, a length byte before each
+    NUM_COLUMNS
+} SegmentColumn;
+
+// Segment encodings, as flags; 0 is fixed-width columns throughout.
+typedef enum {
+    ENCODING_GORILLA = 1,      // numbers delta-of-delta and XOR coded, see encode_deltas
+    ENCODING_PACKED_CODES = 2  // device codes bit-packed, see write_device_codes
+} SegmentEncoding;
+
+// Fixed-size trailer of every segment file. Readers check it before
+// touching any column and skip the segment when the filter cannot match.
+typedef struct {
+    char magic[8];
+    long long rows;
+    int num_devices;
+    int first_date;            // both 0 for the segment of undated rows
+    int last_date;
+    int encoding;              // SegmentEncoding flags
+    long long offsets[NUM_COLUMNS + 1];   // the last one is where the footer starts
+    double sensor_min[NUM_SENSORS];
+    double sensor_max[NUM_SENSORS];
+    long long sensor_count[NUM_SENSORS];  // readings present, NaN excluded
+} SegmentFooter;
+
+// One block of decoded compressed columns.
+typedef struct {
+    long long ids[SEGMENT_BLOCK];
+    long long seqs[SEGMENT_BLOCK];
+    long long stamps[SEGMENT_BLOCK];
+    int codes[SEGMENT_BLOCK];
+    double values[NUM_SENSORS + 2][SEGMENT_BLOCK];   // sensors, latitude, longitude
+} SegmentBlock;
+
+typedef struct {
+    char file[64];
+    int first_date;
+    int last_date;
+    long long rows;
+} ManifestEntry;
+
+#ifdef _WIN32
+#define make_directory(path) _mkdir(path)
+#else
+#define make_directory(path) mkdir((path), 0777)
+#endif
+
+// Flushes a file to the disk so a rename that follows cannot outlive it.
+static int sync_file(FILE *file) {
+    if (fflush(file) != 0) {
+        return 0;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Makes the renames inside `dir` durable. Windows has no directory sync.
+static int sync_directory(const char *dir) {
+#ifdef _WIN32
+    (void)dir;
+    return 1;
+#else
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+#ifdef _WIN32
+typedef HANDLE StoreLock;
+#else
+typedef int StoreLock;
+#endif
+
+// Takes the store's exclusive lock, waiting for another ingest that holds
+// it. The lock goes away with the process, so a crash leaves none behind.
+static int lock_store(const char *dir, StoreLock *lock) {
+    char path[PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", dir, LOCK_NAME);
+#ifdef _WIN32
+    int waiting = 0;
+    for (;;) {
+        *lock = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (*lock != INVALID_HANDLE_VALUE) {
+            return 1;
+        }
+        if (GetLastError() != ERROR_SHARING_VIOLATION) {
+            fprintf(stderr, "Failed to lock %s\n", path);
+            return 0;
+        }
+        if (!waiting) {
+            fprintf(stderr, "Waiting for another ingest into %s\n", dir);
+            waiting = 1;
+        }
+        Sleep(200);
+    }
+#else
+    struct flock range;
+    memset(&range, 0, sizeof(range));
+    range.l_type = F_WRLCK;
+    range.l_whence = SEEK_SET;
+    *lock = open(path, O_RDWR | O_CREAT, 0666);
+    if (*lock < 0) {
+        perror("Failed to lock store");
+        return 0;
+    }
+    if (fcntl(*lock, F_SETLK, &range) != 0) {
+        fprintf(stderr, "Waiting for another ingest into %s\n", dir);
+        if (fcntl(*lock, F_SETLKW, &range) != 0) {
+            perror("Failed to lock store");
+            close(*lock);
+            return 0;
+        }
+    }
+    return 1;
+#endif
+}
+
+static void unlock_store(StoreLock lock) {
+#ifdef _WIN32
+    CloseHandle(lock);
+#else
+    close(lock);
+#endif
+}
+
+// Reads the manifest of a store; a missing manifest is an empty store.
+static int load_manifest(const char *dir, ManifestEntry **entries, int *count) {
+    char path[PATH_LENGTH];
+    char line[MAX_LINE_LENGTH];
+    int capacity = 16;
+
+    *count = 0;
+    *entries = (ManifestEntry *)malloc(capacity * sizeof(ManifestEntry));
+    if (!*entries) {
+        perror("Memory allocation failed");
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, MANIFEST_NAME);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 1;
+    }
+
+    fgets(line, sizeof(line), file);  // header
+    while (fgets(line, sizeof(line), file)) {
+        ManifestEntry entry;
+        if (sscanf(line, "%63[^;];%d;%d;%lld", entry.file, &entry.first_date, &entry.last_date, &entry.rows) != 4) {
+            continue;
+        }
+        if (*count == capacity) {
+            ManifestEntry *grown = (ManifestEntry *)realloc(*entries, 2 * capacity * sizeof(ManifestEntry));
+            if (!grown) {
+                perror("Memory allocation failed");
+                fclose(file);
+                free(*entries);
+                return 0;
+            }
+            *entries = grown;
+            capacity *= 2;
+        }
+        (*entries)[(*count)++] = entry;
+    }
+    fclose(file);
+    return 1;
+}
+
+// Replaces the manifest in one step, so readers see either the old or the
+// new list of segments.
+static int save_manifest(const char *dir, const ManifestEntry *entries, int count) {
+    char path[PATH_LENGTH];
+    char temp_path[PATH_LENGTH + 8];
+    snprintf(path, sizeof(path), "%s/%s", dir, MANIFEST_NAME);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        perror("Failed to write manifest");
+        return 0;
+    }
+    fprintf(file, "segmento;primeira_data;ultima_data;linhas\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "%s;%d;%d;%lld\n", entries[i].file, entries[i].first_date, entries[i].last_date,
+                entries[i].rows);
+    }
+    if (!sync_file(file) | (fclose(file) != 0)) {
+        perror("Failed to write manifest");
+        return 0;
+    }
+#ifdef _WIN32
+    remove(path);
+#endif
+    if (rename(temp_path, path) != 0 || !sync_directory(dir)) {
+        perror("Failed to replace manifest");
+        return 0;
+    }
+    return 1;
+}
+
+// Appends a column padded to 8 bytes and records where it starts.
+static int write_column(FILE *file, const void *data, size_t size, long long *offset) {
+    static const char padding[8] = {0};
+    *offset = ftell(file);
+    if (size > 0 && fwrite(data, 1, size, file) != size) {
+        return 0;
+    }
+    size_t pad = (8 - size % 8) % 8;
+    return pad == 0 || fwrite(padding, 1, pad, file) == pad;
+}
+
+// Bit streams for the compressed segment columns, most significant bit
+// first. Values wider than 32 bits are written in two pieces so the
+// pending word never overflows.
+typedef struct {
+    unsigned char *out;
+    size_t length;
+    unsigned long long pending;
+    int pending_bits;
+} BitWriter;
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;                // in bits
+} BitReader;
+
+static void put_bits(BitWriter *w, unsigned long long value, int n) {
+    if (n > 32) {
+        put_bits(w, value >> 32, n - 32);
+        n = 32;
+    }
+    w->pending = w->pending << n | (value & ((1ULL << n) - 1));
+    w->pending_bits += n;
+    while (w->pending_bits >= 8) {
+        w->pending_bits -= 8;
+        w->out[w->length++] = (unsigned char)(w->pending >> w->pending_bits);
+    }
+    w->pending &= (1ULL << w->pending_bits) - 1;
+}
+
+static void finish_bits(BitWriter *w) {
+    if (w->pending_bits > 0) {
+        w->out[w->length++] = (unsigned char)(w->pending << (8 - w->pending_bits));
+    }
+    w->pending = 0;
+    w->pending_bits = 0;
+}
+
+// The next 64 bits of the stream, zero past its end.
+static inline unsigned long long peek_bits(const BitReader *r) {
+    size_t byte = r->pos >> 3;
+    unsigned long long word = 0;
+    if (byte + 8 <= r->size) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(&word, r->data + byte, 8);
+        word = __builtin_bswap64(word);
+#else
+        for (int k = 0; k < 8; k++) {
+            word = word << 8 | r->data[byte + k];
+        }
+#endif
+    } else {
+        for (int k = 0; k < 8; k++) {
+            word = word << 8 | (byte + k < r->size ? r->data[byte + k] : 0);
+        }
+    }
+    return word << (r->pos & 7);
+}
+
+// Reads 1..64 bits.
+static inline unsigned long long get_bits(BitReader *r, int n) {
+    if (n > 32) {
+        unsigned long long high = get_bits(r, n - 32);
+        return high << 32 | get_bits(r, 32);
+    }
+    unsigned long long value = peek_bits(r) >> (64 - n);
+    r->pos += n;
+    return value;
+}
+
+static inline long long sign_extend(unsigned long long value, int bits) {
+    unsigned long long sign = 1ULL << (bits - 1);
+    return (long long)((value ^ sign) - sign);
+}
+
+static inline int leading_zeros(unsigned long long x) {
+#ifdef __GNUC__
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    while (!(x & (1ULL << 63))) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static inline int trailing_zeros(unsigned long long x) {
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// Delta-of-delta coding of integer columns, as in Facebook's Gorilla: the
+// first value in full, then the change in the step between neighbours
+// with a prefix of 0, 10, 110, 1110, 11110 or 11111 for 0, 7, 9, 12, 32
+// or 64 bits. Counters and timestamps that advance steadily cost about a
+// bit a row; the 32-bit step, which Gorilla lacks, keeps ids that jump
+// around within a device's rows well under their raw size.
+static void encode_deltas(BitWriter *w, const long long *values, int n) {
+    unsigned long long prev = (unsigned long long)values[0];
+    unsigned long long prev_delta = 0;
+    put_bits(w, prev, 64);
+    for (int i = 1; i < n; i++) {
+        unsigned long long delta = (unsigned long long)values[i] - prev;
+        long long dod = (long long)(delta - prev_delta);
+        if (dod == 0) {
+            put_bits(w, 0, 1);
+        } else if (dod >= -64 && dod < 64) {
+            put_bits(w, 2, 2);
+            put_bits(w, (unsigned long long)dod, 7);
+        } else if (dod >= -256 && dod < 256) {
+            put_bits(w, 6, 3);
+            put_bits(w, (unsigned long long)dod, 9);
+        } else if (dod >= -2048 && dod < 2048) {
+            put_bits(w, 14, 4);
+            put_bits(w, (unsigned long long)dod, 12);
+        } else if (dod >= INT_MIN && dod <= INT_MAX) {
+            put_bits(w, 30, 5);
+            put_bits(w, (unsigned long long)dod, 32);
+        } else {
+            put_bits(w, 31, 5);
+            put_bits(w, (unsigned long long)dod, 64);
+        }
+        prev = (unsigned long long)values[i];
+        prev_delta = delta;
+    }
+}
+
+static void decode_deltas(BitReader *r, long long *values, int n) {
+    unsigned long long prev = get_bits(r, 64);
+    unsigned long long delta = 0;
+    values[0] = (long long)prev;
+    for (int i = 1; i < n; i++) {
+        unsigned long long head = peek_bits(r);
+        if (!(head >> 63)) {
+            r->pos += 1;
+        } else if (!(head >> 62 & 1)) {
+            r->pos += 2;
+            delta += (unsigned long long)sign_extend(get_bits(r, 7), 7);
+        } else if (!(head >> 61 & 1)) {
+            r->pos += 3;
+            delta += (unsigned long long)sign_extend(get_bits(r, 9), 9);
+        } else if (!(head >> 60 & 1)) {
+            r->pos += 4;
+            delta += (unsigned long long)sign_extend(get_bits(r, 12), 12);
+        } else if (!(head >> 59 & 1)) {
+            r->pos += 5;
+            delta += (unsigned long long)sign_extend(get_bits(r, 32), 32);
+        } else {
+            r->pos += 5;
+            delta += get_bits(r, 64);
+        }
+        prev += delta;
+        values[i] = (long long)prev;
+    }
+}
+
+// XOR coding of float columns, also from Gorilla: a value equal to the
+// previous one is a single 0 bit; otherwise only the bits that differ are
+// stored, reusing the previous window of leading and trailing zeros when
+// they fit in it. Readings that repeat or drift slowly shrink the most.
+static void encode_xor(BitWriter *w, const double *values, int n) {
+    unsigned long long prev;
+    int lead = -1, trail = 0;
+    memcpy(&prev, &values[0], sizeof(prev));
+    put_bits(w, prev, 64);
+    for (int i = 1; i < n; i++) {
+        unsigned long long bits;
+        memcpy(&bits, &values[i], sizeof(bits));
+        unsigned long long x = bits ^ prev;
+        prev = bits;
+        if (x == 0) {
+            put_bits(w, 0, 1);
+            continue;
+        }
+        int l = leading_zeros(x), t = trailing_zeros(x);
+        if (lead >= 0 && l >= lead && t >= trail) {
+            put_bits(w, 2, 2);
+            put_bits(w, x >> trail, 64 - lead - trail);
+        } else {
+            put_bits(w, 3, 2);
+            put_bits(w, (unsigned long long)l, 6);
+            put_bits(w, (unsigned long long)(63 - l - t), 6);   // length - 1
+            put_bits(w, x >> t, 64 - l - t);
+            lead = l;
+            trail = t;
+        }
+    }
+}
+
+static void decode_xor(BitReader *r, double *values, int n) {
+    unsigned long long prev = get_bits(r, 64);
+    int lead = 0, trail = 0;
+    memcpy(&values[0], &prev, sizeof(prev));
+    for (int i = 1; i < n; i++) {
+        unsigned long long head = peek_bits(r);
+        if (!(head >> 63)) {
+            r->pos += 1;
+        } else {
+            r->pos += 2;
+            if (head >> 62 & 1) {
+                lead = (int)get_bits(r, 6);
+                trail = 64 - lead - (int)get_bits(r, 6) - 1;
+                if (trail < 0) {
+                    trail = 0;         // corrupt; caught by the length check
+                }
+            }
+            prev ^= get_bits(r, 64 - lead - trail) << trail;
+        }
+        memcpy(&values[i], &prev, sizeof(prev));
+    }
+}
+
+// Compressed columns start with a table of num_blocks + 1 offsets, relative
+// to the column, of every block's bit stream, so blocks decode on their own.
+static int write_packed_column(FILE *file, const void *values, long long rows, int floats, long long *offset) {
+    long long num_blocks = (rows + SEGMENT_BLOCK - 1) / SEGMENT_BLOCK;
+    size_t table = (size_t)(num_blocks + 1) * sizeof(long long);
+    unsigned char *data = (unsigned char *)malloc(table + (size_t)rows * 10 + (size_t)num_blocks * 16);
+    if (!data) {
+        return 0;
+    }
+    long long *starts = (long long *)data;
+    BitWriter w = {data + table, 0, 0, 0};
+    for (long long b = 0; b < num_blocks; b++) {
+        long long first = b * SEGMENT_BLOCK;
+        int n = rows - first < SEGMENT_BLOCK ? (int)(rows - first) : SEGMENT_BLOCK;
+        starts[b] = (long long)(table + w.length);
+        if (floats) {
+            encode_xor(&w, (const double *)values + first, n);
+        } else {
+            encode_deltas(&w, (const long long *)values + first, n);
+        }
+        finish_bits(&w);
+    }
+    starts[num_blocks] = (long long)(table + w.length);
+    int ok = write_column(file, data, table + w.length, offset);
+    free(data);
+    return ok;
+}
+
+// The bits needed for codes below `num_devices`; none for a single device.
+static int code_bits(int num_devices) {
+    int bits = 0;
+    while (bits < 31 && (1 << bits) < num_devices) {
+        bits++;
+    }
+    return bits;
+}
+
+// A packed device column is the code width as a long long, then every code
+// in that many bits. A month of a few dozen devices takes 5 or 6 bits a row
+// instead of the name the CSV repeats on every line.
+static int write_device_codes(FILE *file, const int *codes, long long rows, int num_devices, long long *offset) {
+    long long bits = code_bits(num_devices);
+    unsigned char *data = (unsigned char *)malloc(sizeof(long long) + (size_t)(rows * bits + 7) / 8);
+    if (!data) {
+        return 0;
+    }
+    memcpy(data, &bits, sizeof(bits));
+    BitWriter w = {data + sizeof(long long), 0, 0, 0};
+    for (long long i = 0; bits > 0 && i < rows; i++) {
+        put_bits(&w, (unsigned long long)codes[i], (int)bits);
+    }
+    finish_bits(&w);
+    int ok = write_column(file, data, sizeof(long long) + w.length, offset);
+    free(data);
+    return ok;
+}
+
+// Writes the records at `order[0..rows)` as one segment and fills in its
+// manifest dates. `codes` must hold dict->count entries set to -1; it is
+// left that way.
+static int write_segment(const char *path, const SensorRecord *records, const long long *order, long long rows,
+                         const DeviceDict *dict, int *codes, void *buffer, ManifestEntry *entry) {
+    SegmentFooter footer;
+    memset(&footer, 0, sizeof(footer));
+    memcpy(footer.magic, SEGMENT_MAGIC, sizeof(footer.magic));
+    footer.rows = rows;
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return 0;
+    }
+    long long *longs = (long long *)buffer;
+    int *ints = (int *)buffer;
+    double *doubles = (double *)buffer;
+    unsigned char *bytes = (unsigned char *)buffer;
+    int ok = 1;
+
+    footer.encoding = ENCODING_GORILLA | ENCODING_PACKED_CODES;
+    for (long long i = 0; i < rows; i++) {
+        longs[i] = records[order[i]].id;
+    }
+    ok = ok && write_packed_column(file, longs, rows, 0, &footer.offsets[COLUMN_ID]);
+    for (long long i = 0; i < rows; i++) {
+        longs[i] = records[order[i]].seq;
+    }
+    ok = ok && write_packed_column(file, longs, rows, 0, &footer.offsets[COLUMN_SEQ]);
+
+    // Codes are handed out in order of first appearance in the segment.
+    int *names = (int *)malloc((dict->count > 0 ? dict->count : 1) * sizeof(int));
+    if (!names) {
+        fclose(file);
+        return 0;
+    }
+    for (long long i = 0; i < rows; i++) {
+        int id = records[order[i]].device_id;
+        if (codes[id] < 0) {
+            names[footer.num_devices] = id;
+            codes[id] = footer.num_devices++;
+        }
+        ints[i] = codes[id];
+    }
+    ok = ok && write_device_codes(file, ints, rows, footer.num_devices, &footer.offsets[COLUMN_DEVICE]);
+
+    // Date and time share one column as date * 86400 + time, which steps
+    // like a timestamp within a day and decodes without a calendar.
+    footer.first_date = rows > 0 ? records[order[0]].date : 0;
+    footer.last_date = footer.first_date;
+    for (long long i = 0; i < rows; i++) {
+        const SensorRecord *record = &records[order[i]];
+        longs[i] = record->date * 86400LL + record->time;
+        if (record->date < footer.first_date) {
+            footer.first_date = record->date;
+        }
+        if (record->date > footer.last_date) {
+            footer.last_date = record->date;
+        }
+    }
+    ok = ok && write_packed_column(file, longs, rows, 0, &footer.offsets[COLUMN_DATE]);
+    ok = ok && write_column(file, NULL, 0, &footer.offsets[COLUMN_TIME]);
+
+    for (int s = 0; s < NUM_SENSORS; s++) {
+        footer.sensor_min[s] = INFINITY;
+        footer.sensor_max[s] = -INFINITY;
+        for (long long i = 0; i < rows; i++) {
+            const SensorRecord *record = &records[order[i]];
+            doubles[i] = record->values[s];
+            if (((record->valid >> s) & 1) && doubles[i] == doubles[i]) {
+                footer.sensor_count[s]++;
+                if (doubles[i] < footer.sensor_min[s]) {
+                    footer.sensor_min[s] = doubles[i];
+                }
+                if (doubles[i] > footer.sensor_max[s]) {
+                    footer.sensor_max[s] = doubles[i];
+                }
+            }
+        }
+        ok = ok && write_packed_column(file, doubles, rows, 1, &footer.offsets[COLUMN_VALUES + s]);
+    }
+    for (long long i = 0; i < rows; i++) {
+        doubles[i] = records[order[i]].latitude;
+    }
+    ok = ok && write_packed_column(file, doubles, rows, 1, &footer.offsets[COLUMN_LATITUDE]);
+    for (long long i = 0; i < rows; i++) {
+        doubles[i] = records[order[i]].longitude;
+    }
+    ok = ok && write_packed_column(file, doubles, rows, 1, &footer.offsets[COLUMN_LONGITUDE]);
+    for (long long i = 0; i < rows; i++) {
+        bytes[i] = records[order[i]].valid;
+    }
+    ok = ok && write_column(file, bytes, rows, &footer.offsets[COLUMN_VALID]);
+
+    size_t used = 0;
+    for (int c = 0; c < footer.num_devices; c++) {
+        size_t len = strlen(dict->names[names[c]]);
+        bytes[used++] = (unsigned char)len;
+        memcpy(bytes + used, dict->names[names[c]], len);
+        used += len;
+        codes[names[c]] = -1;
+    }
+    free(names);
+    ok = ok && write_column(file, bytes, used, &footer.offsets[COLUMN_DICTIONARY]);
+
+    footer.offsets[NUM_COLUMNS] = ftell(file);
+    ok = ok && fwrite(&footer, sizeof(footer), 1, file) == 1;
+    entry->first_date = footer.first_date;
+    entry->last_date = footer.last_date;
+    entry->rows = rows;
+    ok = ok && sync_file(file);
+    return fclose(file) == 0 && ok;
+}
+
+// Stores the records as new segments, one per month (undated rows get a
+// segment of their own), sorted by device and time within each. Each file
+// is written under a temporary name, synced and renamed once complete; the
+// manifest is replaced last. The store stays locked throughout, so
+// concurrent ingests take turns. Takes ownership of the records.
+static int write_store(const char *dir, SensorRecord *records, long long count, const DeviceDict *dict) {
+    ManifestEntry *entries;
+    int num_entries;
+    DeviceSegment *segments = NULL;
+    StoreLock lock;
+    int ok = 1;
+
+    make_directory(dir);
+    if (!lock_store(dir, &lock)) {
+        free(records);
+        return 0;
+    }
+    if (!load_manifest(dir, &entries, &num_entries)) {
+        unlock_store(lock);
+        free(records);
+        return 0;
+    }
+    if (!sort_records_by_device(&records, count, dict->count, &segments)) {
+        unlock_store(lock);
+        free(entries);
+        free(records);
+        return 0;
+    }
+    free(segments);
+
+    // Stable counting sort of the positions by month, keeping the device
+    // order within a month. Bucket 0 holds the undated rows.
+    int first_month = 0, last_month = 0;
+    for (long long i = 0; i < count; i++) {
+        if (records[i].date > 0) {
+            int month = time_ordinal(BUCKET_MONTH, &records[i]);
+            if (last_month == 0 || month < first_month) {
+                first_month = month;
+            }
+            if (last_month == 0 || month > last_month) {
+                last_month = month;
+            }
+        }
+    }
+    int num_buckets = last_month - first_month + 2;
+    long long *starts = (long long *)calloc(num_buckets, sizeof(long long));
+    long long *order = (long long *)malloc(count * sizeof(long long));
+    int *codes = (int *)malloc((dict->count > 0 ? dict->count : 1) * sizeof(int));
+    void *buffer = malloc(count * sizeof(double) + DEVICE_NAME_LENGTH * (size_t)dict->count);
+    ManifestEntry *grown = (ManifestEntry *)realloc(entries, (num_entries + num_buckets) * sizeof(ManifestEntry));
+    if (grown) {
+        entries = grown;
+    }
+    if (!starts || !order || !codes || !buffer || !grown) {
+        perror("Memory allocation failed");
+        ok = 0;
+    }
+
+    int written = 0;
+    if (ok) {
+        for (long long i = 0; i < count; i++) {
+            starts[records[i].date > 0 ? time_ordinal(BUCKET_MONTH, &records[i]) - first_month + 1 : 0]++;
+        }
+        long long offset = 0;
+        for (int b = 0; b < num_buckets; b++) {
+            long long n = starts[b];
+            starts[b] = offset;
+            offset += n;
+        }
+        for (long long i = 0; i < count; i++) {
+            order[starts[records[i].date > 0 ? time_ordinal(BUCKET_MONTH, &records[i]) - first_month + 1 : 0]++] = i;
+        }
+        // starts[b] now holds where bucket b + 1 begins.
+        for (int i = 0; i < dict->count; i++) {
+            codes[i] = -1;
+        }
+
+        for (int b = 0; ok && b < num_buckets; b++) {
+            long long begin = b > 0 ? starts[b - 1] : 0;
+            long long rows = starts[b] - begin;
+            if (rows == 0) {
+                continue;
+            }
+            ManifestEntry *entry = &entries[num_entries + written];
+            int month = first_month + b - 1;
+            snprintf(entry->file, sizeof(entry->file), "%06d-%06d.seg", num_entries + written + 1,
+                     b > 0 ? month / 12 * 100 + month % 12 + 1 : 0);
+
+            char path[PATH_LENGTH];
+            char temp_path[PATH_LENGTH + 8];
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->file);
+            snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+            if (!write_segment(temp_path, records, order + begin, rows, dict, codes, buffer, entry) ||
+                rename(temp_path, path) != 0) {
+                perror("Failed to write segment");
+                remove(temp_path);
+                ok = 0;
+                break;
+            }
+            written++;
+        }
+    }
+    // The segments must be in the directory before the manifest names them.
+    if (ok && !sync_directory(dir)) {
+        perror("Failed to sync store");
+        ok = 0;
+    }
+    if (ok) {
+        ok = save_manifest(dir, entries, num_entries + written);
+    }
+    if (ok) {
+        printf("Stored %lld records in %d new segments under %s\n", count, written, dir);
+    }
+    unlock_store(lock);
+
+    free(starts);
+    free(order);
+    free(codes);
+    free(buffer);
+    free(entries);
+    free(records);
+    return ok;
+}
+
+// Whether a comparison can come out true, and false, for some value in
+// [lo, hi].
+static void compare_range(CompareOp cmp, double lo, double hi, double value, int *may_true, int *may_false) {
+    switch (cmp) {
+        case CMP_LT: *may_true = lo < value; *may_false = hi >= value; break;
+        case CMP_LE: *may_true = lo <= value; *may_false = hi > value; break;
+        case CMP_GT: *may_true = hi > value; *may_false = lo <= value; break;
+        case CMP_GE: *may_true = hi >= value; *may_false = lo < value; break;
+        case CMP_EQ: *may_true = lo <= value && value <= hi; *may_false = lo != value || hi != value; break;
+        case CMP_NE: *may_true = lo != value || hi != value; *may_false = lo <= value && value <= hi; break;
+    }
+}
+
+// Runs the filter over what the footer says about a segment instead of over
+// rows. Returns 0 only when no row of the segment can match.
+static int segment_may_match(const FilterProgram *prog, const SegmentFooter *footer) {
+    unsigned char may_true[MAX_FILTER_DEPTH];
+    unsigned char may_false[MAX_FILTER_DEPTH];
+    int top = -1;
+
+    if (prog->length == 0) {
+        return 1;
+    }
+    for (int i = 0; i < prog->length; i++) {
+        const FilterInstr *instr = &prog->code[i];
+        int t = 1, f = 1;
+
+        switch (instr->opcode) {
+            case FILTER_DATE:
+                if (footer->first_date == 0) {
+                    t = 0;           // undated rows never match a date
+                } else {
+                    compare_range(instr->cmp, footer->first_date / instr->date_divisor,
+                                  footer->last_date / instr->date_divisor, instr->value, &t, &f);
+                }
+                break;
+            case FILTER_SENSOR: {
+                int s = instr->sensor;
+                if (footer->sensor_count[s] == 0) {
+                    t = 0;
+                } else {
+                    compare_range(instr->cmp, footer->sensor_min[s], footer->sensor_max[s], instr->value, &t, &f);
+                    f |= footer->sensor_count[s] < footer->rows;
+                }
+                break;
+            }
+            case FILTER_DEVICE_EQ:
+            case FILTER_DEVICE_PREFIX:
+            case FILTER_DEVICE_REGEX:
+                break;
+            case FILTER_AND:
+                top--;
+                t = may_true[top] && may_true[top + 1];
+                f = may_false[top] || may_false[top + 1];
+                top--;
+                break;
+            case FILTER_OR:
+                top--;
+                t = may_true[top] || may_true[top + 1];
+                f = may_false[top] && may_false[top + 1];
+                top--;
+                break;
+            case FILTER_NOT:
+                t = may_false[top];
+                f = may_true[top];
+                top--;
+                break;
+        }
+        top++;
+        may_true[top] = (unsigned char)t;
+        may_false[top] = (unsigned char)f;
+    }
+    return may_true[0];
+}
+
+// Maps a segment and checks that its footer and columns fit in the file.
+static int open_segment(const char *path, MappedFile *mapped, SegmentFooter *footer) {
+    if (!map_file(path, mapped)) {
+        return 0;
+    }
+    if (mapped->size < (long long)sizeof(SegmentFooter)) {
+        unmap_file(mapped);
+        return 0;
+    }
+    memcpy(footer, mapped->data + mapped->size - sizeof(SegmentFooter), sizeof(SegmentFooter));
+    int ok = memcmp(footer->magic, SEGMENT_MAGIC, sizeof(footer->magic)) == 0 && footer->rows >= 0 &&
+             footer->num_devices >= 0 && footer->offsets[NUM_COLUMNS] == mapped->size - (long long)sizeof(SegmentFooter);
+    int packed = footer->encoding & ENCODING_GORILLA;
+    long long table = ((footer->rows + SEGMENT_BLOCK - 1) / SEGMENT_BLOCK + 1) * (long long)sizeof(long long);
+    long long device_size = footer->rows * 4;
+    ok = ok && (footer->encoding & ~(ENCODING_GORILLA | ENCODING_PACKED_CODES)) == 0;
+    if (ok && (footer->encoding & ENCODING_PACKED_CODES)) {
+        long long bits = -1;
+        if (footer->offsets[COLUMN_DEVICE] >= 0 &&
+            footer->offsets[COLUMN_DEVICE] + (long long)sizeof(bits) <= footer->offsets[NUM_COLUMNS]) {
+            memcpy(&bits, mapped->data + footer->offsets[COLUMN_DEVICE], sizeof(bits));
+        }
+        ok = bits == code_bits(footer->num_devices);
+        device_size = (long long)sizeof(bits) + (footer->rows * bits + 7) / 8;
+    }
+    for (int c = 0; ok && c < NUM_COLUMNS; c++) {
+        long long size = c == COLUMN_DICTIONARY ? 0 :
+                         c == COLUMN_VALID ? footer->rows :
+                         c == COLUMN_DEVICE ? device_size :
+                         packed && c == COLUMN_TIME ? 0 :
+                         packed ? table :
+                         c == COLUMN_DATE || c == COLUMN_TIME ? footer->rows * 4 : footer->rows * 8;
+        ok = footer->offsets[c] >= 0 && footer->offsets[c] % 8 == 0 &&
+             footer->offsets[c] + size <= footer->offsets[c + 1];
+    }
+    if (!ok) {
+        unmap_file(mapped);
+    }
+    return ok;
+}
+
+// Decodes block `block` of a compressed column into `out`. Returns 0 when
+// the block is damaged.
+static int decode_packed_block(const char *column, long long size, long long block, int n, int floats, void *out) {
+    long long start, end;
+    memcpy(&start, column + block * sizeof(long long), sizeof(start));
+    memcpy(&end, column + (block + 1) * sizeof(long long), sizeof(end));
+    if (start < 0 || start > end || end > size) {
+        return 0;
+    }
+    BitReader r = {(const unsigned char *)column + start, (size_t)(size - start), 0};
+    if (floats) {
+        decode_xor(&r, (double *)out, n);
+    } else {
+        decode_deltas(&r, (long long *)out, n);
+    }
+    return r.pos <= (size_t)(end - start) * 8;
+}
+
+// Decodes one mapped segment into the loader, a block of rows at a time so
+// the decoded columns stay in cache. Device names are interned once per
+// segment; rows then only translate their code.
+static int load_segment(Loader *loader, const MappedFile *mapped, const SegmentFooter *footer) {
+    const char *base = mapped->data;
+    const unsigned char *valid = (const unsigned char *)(base + footer->offsets[COLUMN_VALID]);
+    int packed = footer->encoding & ENCODING_GORILLA;
+    int packed_codes = footer->encoding & ENCODING_PACKED_CODES;
+    int bits = packed_codes ? code_bits(footer->num_devices) : 0;
+    BitReader code_reader = {NULL, 0, 0};
+    SegmentBlock *decoded = NULL;
+    if (packed_codes) {
+        code_reader.data = (const unsigned char *)base + footer->offsets[COLUMN_DEVICE] + sizeof(long long);
+        code_reader.size = (size_t)(footer->offsets[COLUMN_DEVICE + 1] - footer->offsets[COLUMN_DEVICE]) -
+                           sizeof(long long);
+    }
+
+    // Code c of this segment is device_ids[c]; rows never touch a name.
+    int *device_ids = (int *)malloc((footer->num_devices > 0 ? footer->num_devices : 1) * sizeof(int));
+    if (packed || packed_codes) {
+        decoded = (SegmentBlock *)malloc(sizeof(SegmentBlock));
+    }
+    if (!device_ids || ((packed || packed_codes) && !decoded)) {
+        free(device_ids);
+        free(decoded);
+        return -1;
+    }
+    int status = 1;
+    const unsigned char *name = (const unsigned char *)(base + footer->offsets[COLUMN_DICTIONARY]);
+    const unsigned char *names_end = (const unsigned char *)(base + footer->offsets[NUM_COLUMNS]);
+    for (int c = 0; status > 0 && c < footer->num_devices; c++) {
+        if (name >= names_end || name + 1 + *name > names_end) {
+            status = 0;
+            break;
+        }
+        device_ids[c] = device_dict_intern_bytes(loader->dict, (const char *)name + 1, *name);
+        if (device_ids[c] < 0) {
+            status = -1;
+        }
+        name += 1 + *name;
+    }
+
+    for (long long first = 0; status > 0 && first < footer->rows; first += SEGMENT_BLOCK) {
+        int n = footer->rows - first < SEGMENT_BLOCK ? (int)(footer->rows - first) : SEGMENT_BLOCK;
+        const long long *ids, *seqs, *stamps = NULL;
+        const int *codes, *dates = NULL, *times = NULL;
+        const double *values[NUM_SENSORS + 2];   // sensors, latitude, longitude
+
+        if (packed_codes) {
+            for (int i = 0; i < n; i++) {
+                decoded->codes[i] = bits > 0 ? (int)get_bits(&code_reader, bits) : 0;
+            }
+            codes = decoded->codes;
+        } else {
+            codes = (const int *)(base + footer->offsets[COLUMN_DEVICE]) + first;
+        }
+        if (packed) {
+            long long block = first / SEGMENT_BLOCK;
+            const int columns[3] = {COLUMN_ID, COLUMN_SEQ, COLUMN_DATE};
+            long long *targets[3] = {decoded->ids, decoded->seqs, decoded->stamps};
+            for (int c = 0; status > 0 && c < 3; c++) {
+                status = decode_packed_block(base + footer->offsets[columns[c]],
+                                             footer->offsets[columns[c] + 1] - footer->offsets[columns[c]],
+                                             block, n, 0, targets[c]);
+            }
+            for (int s = 0; status > 0 && s < NUM_SENSORS + 2; s++) {
+                int c = COLUMN_VALUES + s;
+                status = decode_packed_block(base + footer->offsets[c], footer->offsets[c + 1] - footer->offsets[c],
+                                             block, n, 1, decoded->values[s]);
+                values[s] = decoded->values[s];
+            }
+            ids = decoded->ids;
+            seqs = decoded->seqs;
+            stamps = decoded->stamps;
+        } else {
+            ids = (const long long *)(base + footer->offsets[COLUMN_ID]) + first;
+            seqs = (const long long *)(base + footer->offsets[COLUMN_SEQ]) + first;
+            dates = (const int *)(base + footer->offsets[COLUMN_DATE]) + first;
+            times = (const int *)(base + footer->offsets[COLUMN_TIME]) + first;
+            for (int s = 0; s < NUM_SENSORS + 2; s++) {
+                values[s] = (const double *)(base + footer->offsets[COLUMN_VALUES + s]) + first;
+            }
+        }
+
+        for (int i = 0; status > 0 && i < n; i++) {
+            int code = codes[i];
+            if (code < 0 || code >= footer->num_devices) {
+                status = 0;
+                break;
+            }
+            SensorRecord *record = &loader->records[loader->kept + loader->batch];
+            record->id = ids[i];
+            record->seq = seqs[i];
+            record->device_id = device_ids[code];
+            if (stamps) {
+                record->date = (int)(stamps[i] / 86400);
+                record->time = (int)(stamps[i] % 86400);
+            } else {
+                record->date = dates[i];
+                record->time = times[i];
+            }
+            for (int s = 0; s < NUM_SENSORS; s++) {
+                record->values[s] = values[s][i];
+            }
+            record->latitude = values[NUM_SENSORS][i];
+            record->longitude = values[NUM_SENSORS + 1][i];
+            record->valid = valid[first + i];
+            if (++loader->batch == FILTER_BATCH && !loader_flush(loader)) {
+                status = -1;
+            }
+        }
+    }
+    if (status > 0) {
+        loader->parsed += footer->rows;
+        atomic_store_explicit(&run_status.rows_parsed, loader->parsed, memory_order_relaxed);
+    }
+    free(device_ids);
+    free(decoded);
+    return status;
+}
+
+// Loads the matching rows of a segment store. Segments whose footer rules
+// out the filter are never read beyond their last page.
+static int read_store(const char *dir, FilterProgram *filter, DeviceDict *dict,
+                      SensorRecord **records, long long *record_count,
+                      long long *min_id, long long *max_id, RowErrors *errors) {
+    ManifestEntry *entries;
+    int num_entries;
+    if (!load_manifest(dir, &entries, &num_entries)) {
+        return 0;
+    }
+    if (num_entries == 0) {
+        fprintf(stderr, "No segments in store %s\n", dir);
+        free(entries);
+        return 0;
+    }
+
+    MappedFile *mapped = (MappedFile *)malloc(num_entries * sizeof(MappedFile));
+    SegmentFooter *footers = (SegmentFooter *)malloc(num_entries * sizeof(SegmentFooter));
+    if (!mapped || !footers) {
+        perror("Memory allocation failed");
+        free(mapped);
+        free(footers);
+        free(entries);
+        return 0;
+    }
+
+    atomic_store_explicit(&run_status.phase, PHASE_PARSING, memory_order_relaxed);
+    int ok = 1, opened = 0, used = 0;
+    long long rows = 0;
+    for (; opened < num_entries; opened++) {
+        char path[PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[opened].file);
+        if (!open_segment(path, &mapped[opened], &footers[opened])) {
+            fprintf(stderr, "Unreadable segment %s\n", path);
+            ok = 0;
+            break;
+        }
+        if (segment_may_match(filter, &footers[opened])) {
+            rows += footers[opened].rows;
+            used++;
+        } else {
+            footers[opened].rows = -1;    // pruned
+        }
+    }
+
+    Loader loader;
+    loader_init(&loader, filter, dict, NULL, NULL);
+    loader.capacity = rows > 0 ? rows : 1;
+    if (ok) {
+        loader.records = (SensorRecord *)malloc((size_t)loader.capacity * sizeof(SensorRecord));
+        if (!loader.records) {
+            perror("Memory allocation failed");
+            ok = 0;
+        }
+    }
+    for (int i = 0; ok && i < opened; i++) {
+        if (footers[i].rows < 0) {
+            continue;
+        }
+        int status = load_segment(&loader, &mapped[i], &footers[i]);
+        if (status == 0) {
+            fprintf(stderr, "Corrupt segment %s/%s\n", dir, entries[i].file);
+            ok = 0;
+        } else if (status < 0) {
+            perror("Memory allocation failed");
+            ok = 0;
+        }
+    }
+    for (int i = 0; i < opened; i++) {
+        unmap_file(&mapped[i]);
+    }
+    if (ok) {
+        printf("Read %d of %d segments from %s\n", used, num_entries, dir);
+    }
+    free(mapped);
+    free(footers);
+    free(entries);
+    if (!ok) {
+        free(loader.records);
+        return 0;
+    }
+    return loader_finish(&loader, 1, records, record_count, min_id, max_id, errors);
+}
+
+// Interactive mode keeps the parsed records in memory and answers queries
+// with a fresh parallel scan each time. Every worker filters its share of
+// the records a batch at a time and aggregates each stretch of consecutive
+// selected records in place, so a query costs no copy of the records.
+typedef struct {
+    ThreadData aggregate;
+    const FilterProgram *filter;
+    long long matched;
+} ScanThreadData;
+
+static void *scan_worker(void *arg) {
+    ScanThreadData *scan = (ScanThreadData *)arg;
+    ThreadData *data = &scan->aggregate;
+    long long start = data->start, end = data->end;
+    scan->matched = end - start;
+    if (scan->filter->length == 0) {
+        return process_records(data);
+    }
+
+    scan->matched = 0;
+    for (long long i = start; i < end && !data->failed; i += FILTER_BATCH) {
+        int selection[FILTER_BATCH];
+        int n = end - i < FILTER_BATCH ? (int)(end - i) : FILTER_BATCH;
+        int selected = filter_select(scan->filter, &data->records[i], n, selection);
+        scan->matched += selected;
+        for (int j = 0; j < selected;) {
+            int k = j + 1;
+            while (k < selected && selection[k] == selection[k - 1] + 1) {
+                k++;
+            }
+            data->start = i + selection[j];
+            data->end = i + selection[k - 1] + 1;
+            process_records(data);
+            j = k;
+        }
+    }
+    return NULL;
+}
+
+// Aggregates the records matching `filter` into `result`. Returns 0 when out
+// of memory.
+static int scan_records(const SensorRecord *records, long long count, const FilterProgram *filter,
+                        const GroupSpec *spec, StatsTable *result, long long *matched) {
+    int num_threads = get_cpu_count();
+    if (num_threads > count) {
+        num_threads = count > 0 ? (int)count : 1;
+    }
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    ScanThreadData *scans = (ScanThreadData *)malloc(num_threads * sizeof(ScanThreadData));
+    if (!threads || !scans) {
+        free(threads);
+        free(scans);
+        return 0;
+    }
+    IdSet no_ids;                  // duplicates were dropped at load
+    id_set_init(&no_ids, 0, -1, 0);
+
+    long long per_thread = count / num_threads;
+    long long remaining = count % num_threads;
+    long long start = 0;
+    for (int i = 0; i < num_threads; i++) {
+        ThreadData *data = &scans[i].aggregate;
+        scans[i].filter = filter;
+        data->records = (SensorRecord *)records;
+        data->start = start;
+        data->end = start + per_thread + (i < remaining ? 1 : 0);
+        data->spec = spec;
+        data->seen_ids = &no_ids;
+        data->duplicates = 0;
+        data->failed = !stats_table_init(&data->table);
+        data->progress = NULL;
+        atomic_init(&data->published, NULL);
+        atomic_init(&data->done, 0);
+        atomic_init(&data->processed, 0LL);
+        start = data->end;
+        pthread_create(&threads[i], NULL, scan_worker, &scans[i]);
+    }
+
+    int failed = 0;
+    *matched = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        *matched += scans[i].matched;
+        failed |= scans[i].aggregate.failed;
+        if (i > 0 && !failed) {
+            failed = !stats_table_merge(&scans[0].aggregate.table, &scans[i].aggregate.table);
+        }
+    }
+    *result = scans[0].aggregate.table;
+    for (int i = 1; i < num_threads; i++) {
+        stats_table_free(&scans[i].aggregate.table);
+    }
+    if (failed) {
+        stats_table_free(result);
+    }
+    free(threads);
+    free(scans);
+    return !failed;
+}
+
+// Drops every record whose id was seen before, keeping the first. Returns
+// the number dropped, or -1 when out of memory.
+static long long drop_duplicates(SensorRecord *records, long long *count, long long min_id, long long max_id) {
+    IdSet seen_ids;
+    if (!id_set_init(&seen_ids, min_id, max_id, *count)) {
+        perror("Not enough memory for duplicate detection");
+        return -1;
+    }
+    long long kept = 0;
+    for (long long i = 0; i < *count; i++) {
+        if (id_set_insert(&seen_ids, records[i].id)) {
+            records[kept++] = records[i];
+        }
+    }
+    id_set_destroy(&seen_ids);
+    long long duplicates = *count - kept;
+    *count = kept;
+    return duplicates;
+}
+
+// Makes `attr` the metadata group key and recomputes every device's value.
+static int device_meta_set_key(DeviceMeta *meta, const DeviceDict *dict, const char *attr) {
+    int key_attr = -1;
+    for (int i = 0; i < meta->num_attrs; i++) {
+        if (strcmp(meta->attr_names[i], attr) == 0) {
+            key_attr = i;
+        }
+    }
+    if (key_attr < 0) {
+        return 0;
+    }
+    if (key_attr == meta->key_attr) {
+        return 1;
+    }
+    device_dict_free(&meta->key_values);
+    free(meta->row_of_device);
+    free(meta->key_of_device);
+    meta->row_of_device = NULL;
+    meta->key_of_device = NULL;
+    meta->key_attr = key_attr;
+    return device_dict_init(&meta->key_values) && device_meta_bind(meta, dict);
+}
+
+static int parse_sensor_list(const char *text, int *sensors) {
+    int mask = 0;
+    if (strcmp(text, "all") == 0) {
+        *sensors = ALL_SENSORS;
+        return 1;
+    }
+    while (*text) {
+        size_t len = strcspn(text, ",");
+        int found = 0;
+        for (int i = 0; i < NUM_SENSORS; i++) {
+            if (strlen(sensor_names[i]) == len && strncmp(sensor_names[i], text, len) == 0) {
+                mask |= 1 << i;
+                found = 1;
+            }
+        }
+        if (!found) {
+            return 0;
+        }
+        text += len + (text[len] == ',');
+    }
+    *sensors = mask;
+    return mask != 0;
+}
+
+static void print_repl_help(void) {
+    fprintf(stderr, "  filter EXPR        rows to include, e.g. date >= 2024-06 and eco2 > 1000 (empty for all)\n"
+                    "  group-by KEYS      e.g. device,month or geo:0.01,day\n"
+                    "  sensors LIST       e.g. eco2,temperatura, or all\n"
+                    "  show               run the query and print the results\n"
+                    "  save FILE          run the query and write the results to FILE\n"
+                    "  quit\n");
+}
+
+// Reads commands from stdin until quit or end of input. Only the CSV from show
+// goes to stdout; the banner, prompt, help and timings go to stderr so piped
+// output stays plain CSV.
+static int run_interactive(const SensorRecord *records, long long count, const DeviceDict *dict,
+                           DeviceMeta *meta, GroupSpec spec) {
+    char line[MAX_LINE_LENGTH];
+    FilterProgram filter;
+    int sensors = ALL_SENSORS;
+    filter.length = 0;
+
+    fprintf(stderr, "%lld records in memory; type help for commands\n", count);
+    for (;;) {
+        fflush(stdout);
+        fprintf(stderr, "> ");
+        if (!fgets(line, sizeof(line), stdin)) {
+            break;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        char *command = line;
+        while (isspace((unsigned char)*command)) {
+            command++;
+        }
+        char *rest = command + strcspn(command, " \t");
+        if (*rest) {
+            *rest++ = '\0';
+            while (isspace((unsigned char)*rest)) {
+                rest++;
+            }
+        }
+
+        if (*command == '\0') {
+            continue;
+        } else if (strcmp(command, "quit") == 0 || strcmp(command, "exit") == 0) {
+            break;
+        } else if (strcmp(command, "help") == 0) {
+            print_repl_help();
+        } else if (strcmp(command, "filter") == 0) {
+            FilterProgram next;
+            if (filter_compile(&next, rest)) {
+                if (!filter_prepare_devices(&next, dict)) {
+                    perror("Memory allocation failed");
+                    filter_free(&next);
+                    continue;
+                }
+                filter_free(&filter);
+                filter = next;
+            }
+        } else if (strcmp(command, "group-by") == 0) {
+            GroupSpec next = spec;
+            if (!parse_group_by_option(rest, &next)) {
+                fprintf(stderr, "Invalid grouping '%s', expected e.g. device,month or geo:0.01,day\n", rest);
+            } else if ((next.parts & KEY_META) && (!next.meta || !device_meta_set_key(meta, dict, next.meta_attr))) {
+                fprintf(stderr, "Grouping by unknown metadata attribute '%s'\n", next.meta_attr);
+            } else {
+                spec = next;
+            }
+        } else if (strcmp(command, "sensors") == 0) {
+            if (!parse_sensor_list(rest, &sensors)) {
+                fprintf(stderr, "Invalid sensor list '%s'\n", rest);
+            }
+        } else if (strcmp(command, "show") == 0 || (strcmp(command, "save") == 0 && *rest)) {
+            StatsTable result;
+            long long matched;
+            double started = now_seconds();
+            if (!scan_records(records, count, &filter, &spec, &result, &matched)) {
+                perror("Memory allocation failed");
+                continue;
+            }
+            double elapsed = now_seconds() - started;
+            FILE *file = *command == 's' && command[1] == 'a' ? fopen(rest, "w") : stdout;
+            if (!file) {
+                perror("Failed to open output file");
+            } else {
+                write_results(file, result.entries, result.count, &spec, dict, 1.0, NULL, sensors);
+                if (file != stdout) {
+                    fclose(file);
+                }
+            }
+            fflush(stdout);
+            fprintf(stderr, "%lld groups from %lld of %lld records in %.1f ms\n", result.count, matched, count,
+                    elapsed * 1000.0);
+            stats_table_free(&result);
+        } else {
+            fprintf(stderr, "Unknown command '%s', type help for commands\n", command);
+        }
+    }
+    filter_free(&filter);
+    return 1;
+}
+
+// Batch mode evaluates many queries in one pass over the records. Each
+// worker walks its share in FILTER_BATCH blocks and hands every block to
+// every query while it is still in cache: the query's filter selects rows
+// into a small buffer that process_records aggregates into the query's own
+// table for that worker.
+#define MAX_QUERIES 64
+
+typedef struct {
+    char output[PATH_LENGTH];
+    GroupSpec spec;
+    FilterProgram filter;
+    DeviceMeta meta_view;          // own group key values when grouping by meta:ATTR
+} BatchQuery;
+
+typedef struct {
+    const SensorRecord *records;
+    long long start;
+    long long end;
+    const BatchQuery *queries;
+    int num_queries;
+    ThreadData *aggregates;        // one per query
+    long long *matched;            // one per query
+} SharedScanData;
+
+// Gives `view` the metadata of `meta` with `key_attr` as its group key. The
+// view shares the table and owns only its key values and per-device arrays.
+static int device_meta_view(const DeviceMeta *meta, const DeviceDict *dict, int key_attr, DeviceMeta *view) {
+    *view = *meta;
+    view->key_attr = key_attr;
+    view->row_of_device = NULL;
+    view->key_of_device = NULL;
+    if (!device_dict_init(&view->key_values)) {
+        return 0;
+    }
+    return device_meta_bind(view, dict);
+}
+
+static void device_meta_view_free(DeviceMeta *view) {
+    device_dict_free(&view->key_values);
+    free(view->row_of_device);
+    free(view->key_of_device);
+    memset(view, 0, sizeof(*view));
+}
+
+static void free_queries(BatchQuery *queries, int count) {
+    for (int i = 0; i < count; i++) {
+        filter_free(&queries[i].filter);
+        if (queries[i].spec.meta == &queries[i].meta_view) {
+            device_meta_view_free(&queries[i].meta_view);
+        }
+    }
+    free(queries);
+}
+
+// Reads one query per line as "output;group-by;filter". An empty grouping
+// means device,month and an empty filter every row; '#' starts a comment
+// line. `meta` is the loaded metadata table, or NULL.
+static int load_queries(const char *filename, const DeviceMeta *meta, BatchQuery **queries, int *count) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("Failed to open query file");
+        return 0;
+    }
+    BatchQuery *list = (BatchQuery *)calloc(MAX_QUERIES, sizeof(BatchQuery));
+    if (!list) {
+        perror("Memory allocation failed");
+        fclose(file);
+        return 0;
+    }
+
+    char line[MAX_LINE_LENGTH];
+    int line_number = 0;
+    int n = 0;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        char *group_by = strchr(line, ';');
+        char *filter_text = group_by ? strchr(group_by + 1, ';') : NULL;
+        if (!filter_text || group_by == line || group_by - line >= PATH_LENGTH) {
+            fprintf(stderr, "%s:%d: expected output;group-by;filter\n", filename, line_number);
+            ok = 0;
+            break;
+        }
+        if (n == MAX_QUERIES) {
+            fprintf(stderr, "%s:%d: more than %d queries\n", filename, line_number, MAX_QUERIES);
+            ok = 0;
+            break;
+        }
+        *group_by++ = '\0';
+        *filter_text++ = '\0';
+
+        BatchQuery *query = &list[n];
+        strcpy(query->output, line);
+        GroupSpec spec = {KEY_DEVICE | KEY_TIME, BUCKET_MONTH, 0.01, "", meta};
+        int valid = *group_by == '\0' || parse_group_by_option(group_by, &spec);
+        int known = !(spec.parts & KEY_META);
+        for (int i = 0; meta && i < meta->num_attrs; i++) {
+            known |= strcmp(meta->attr_names[i], spec.meta_attr) == 0;
+        }
+        if (!valid) {
+            fprintf(stderr, "%s:%d: invalid grouping '%s', expected e.g. device,month or geo:0.01,day\n",
+                    filename, line_number, group_by);
+            ok = 0;
+        } else if (!known) {
+            fprintf(stderr, "%s:%d: grouping by unknown metadata attribute '%s'\n",
+                    filename, line_number, spec.meta_attr);
+            ok = 0;
+        } else if (!filter_compile(&query->filter, filter_text)) {
+            fprintf(stderr, "%s:%d: invalid filter\n", filename, line_number);
+            ok = 0;
+        } else {
+            query->spec = spec;
+            n++;
+        }
+    }
+    fclose(file);
+
+    if (ok && n == 0) {
+        fprintf(stderr, "%s: no queries\n", filename);
+        ok = 0;
+    }
+    if (!ok) {
+        free_queries(list, n);
+        return 0;
+    }
+    *queries = list;
+    *count = n;
+    return 1;
+}
+
+// Binds the queries to the devices of the loaded data.
+static int prepare_queries(BatchQuery *queries, int count, const DeviceMeta *meta, const DeviceDict *dict) {
+    for (int q = 0; q < count; q++) {
+        if (!filter_prepare_devices(&queries[q].filter, dict)) {
+            return 0;
+        }
+        if (queries[q].spec.parts & KEY_META) {
+            int key_attr = 0;
+            while (strcmp(meta->attr_names[key_attr], queries[q].spec.meta_attr) != 0) {
+                key_attr++;
+            }
+            // Point at the view first so free_queries releases a partial bind.
+            queries[q].spec.meta = &queries[q].meta_view;
+            if (!device_meta_view(meta, dict, key_attr, &queries[q].meta_view)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void *shared_scan_worker(void *arg) {
+    SharedScanData *scan = (SharedScanData *)arg;
+    SensorRecord *selected = (SensorRecord *)malloc(FILTER_BATCH * sizeof(SensorRecord));
+    if (!selected) {
+        scan->aggregates[0].failed = 1;
+        return NULL;
+    }
+
+    for (long long i = scan->start; i < scan->end; i += FILTER_BATCH) {
+        int n = scan->end - i < FILTER_BATCH ? (int)(scan->end - i) : FILTER_BATCH;
+        for (int q = 0; q < scan->num_queries; q++) {
+            ThreadData *data = &scan->aggregates[q];
+            if (scan->queries[q].filter.length == 0) {
+                data->records = (SensorRecord *)scan->records;
+                data->start = i;
+                data->end = i + n;
+            } else {
+                int selection[FILTER_BATCH];
+                int count = filter_select(&scan->queries[q].filter, &scan->records[i], n, selection);
+                for (int j = 0; j < count; j++) {
+                    selected[j] = scan->records[i + selection[j]];
+                }
+                data->records = selected;
+                data->start = 0;
+                data->end = count;
+            }
+            scan->matched[q] += data->end - data->start;
+            process_records(data);
+        }
+    }
+    free(selected);
+    return NULL;
+}
+
+// Runs every query over the records and writes each one's results. Returns
+// 0 when out of memory.
+static int run_shared_scan(const SensorRecord *records, long long count, BatchQuery *queries,
+                           int num_queries, const DeviceDict *dict) {
+    int num_threads = get_cpu_count();
+    if (num_threads > count) {
+        num_threads = count > 0 ? (int)count : 1;
+    }
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    SharedScanData *scans = (SharedScanData *)malloc(num_threads * sizeof(SharedScanData));
+    ThreadData *aggregates = (ThreadData *)malloc((size_t)num_threads * num_queries * sizeof(ThreadData));
+    long long *matched = (long long *)calloc((size_t)num_threads * num_queries, sizeof(long long));
+    if (!threads || !scans || !aggregates || !matched) {
+        free(threads);
+        free(scans);
+        free(aggregates);
+        free(matched);
+        return 0;
+    }
+    IdSet no_ids;                  // duplicates were dropped at load
+    id_set_init(&no_ids, 0, -1, 0);
+
+    double started = now_seconds();
+    long long per_thread = count / num_threads;
+    long long remaining = count % num_threads;
+    long long start = 0;
+    for (int i = 0; i < num_threads; i++) {
+        scans[i].records = records;
+        scans[i].start = start;
+        scans[i].end = start + per_thread + (i < remaining ? 1 : 0);
+        scans[i].queries = queries;
+        scans[i].num_queries = num_queries;
+        scans[i].aggregates = &aggregates[i * num_queries];
+        scans[i].matched = &matched[i * num_queries];
+        for (int q = 0; q < num_queries; q++) {
+            ThreadData *data = &scans[i].aggregates[q];
+            data->spec = &queries[q].spec;
+            data->seen_ids = &no_ids;
+            data->duplicates = 0;
+            data->failed = !stats_table_init(&data->table);
+            data->progress = NULL;
+            atomic_init(&data->published, NULL);
+            atomic_init(&data->done, 0);
+            atomic_init(&data->processed, 0LL);
+        }
+        start = scans[i].end;
+        pthread_create(&threads[i], NULL, shared_scan_worker, &scans[i]);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - started;
+    for (int q = 0; q < num_queries && !failed; q++) {
+        StatsTable *table = &aggregates[q].table;
+        long long total = 0;
+        for (int i = 0; i < num_threads; i++) {
+            const ThreadData *data = &aggregates[i * num_queries + q];
+            total += matched[i * num_queries + q];
+            failed |= data->failed;
+            if (i > 0 && !failed) {
+                failed = !stats_table_merge(table, &data->table);
+            }
+        }
+        if (!failed) {
+            write_results_to_csv(table->entries, table->count, &queries[q].spec, dict, 1.0, NULL,
+                                 queries[q].output);
+            printf("%lld groups from %lld records written to %s\n", table->count, total, queries[q].output);
+        }
+    }
+    if (!failed) {
+        printf("%d queries evaluated in one scan of %lld records in %.1f ms\n", num_queries, count,
+               elapsed * 1000.0);
+    }
+
+    for (int i = 0; i < num_threads * num_queries; i++) {
+        stats_table_free(&aggregates[i].table);
+    }
+    free(threads);
+    free(scans);
+    free(aggregates);
+    free(matched);
+    return !failed;
+}
+
+// Library interface. An analyzer keeps one stats table grouped by device
+// and month behind a read-write lock: ingests take it exclusively, queries
+// and snapshots share it.
+struct IotAnalyzer {
+    pthread_rwlock_t lock;
+    GroupSpec spec;
+    DeviceDict dict;
+    StatsTable table;
+    IdSet seen_ids;            // hash set of every id ingested so far
+    long long num_ids;
+};
+
+struct IotSnapshot {
+    char (*names)[DEVICE_NAME_LENGTH];
+    MonthlyStats *entries;
+    long long count;
+};
+
+static void sensor_stats_from(const MonthlyStats *entry, IotSensorStats stats[IOT_NUM_SENSORS]) {
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        stats[i].count = entry->count[i];
+        stats[i].out_of_range = entry->out_of_range[i];
+        stats[i].min = entry->min[i];
+        stats[i].max = entry->max[i];
+        stats[i].mean = entry->count[i] > 0 ? entry->sum[i] / entry->count[i] : 0.0;
+    }
+}
+
+IotAnalyzer *iot_analyzer_create(void) {
+    if (!bind_kernels(NULL)) {
+        return NULL;
+    }
+
+    IotAnalyzer *analyzer = (IotAnalyzer *)calloc(1, sizeof(IotAnalyzer));
+    if (!analyzer) {
+        return NULL;
+    }
+    GroupSpec spec = {KEY_DEVICE | KEY_TIME, BUCKET_MONTH, 0.01, "", NULL};
+    analyzer->spec = spec;
+    if (!device_dict_init(&analyzer->dict)) {
+        free(analyzer);
+        return NULL;
+    }
+    if (!stats_table_init(&analyzer->table)) {
+        device_dict_free(&analyzer->dict);
+        free(analyzer);
+        return NULL;
+    }
+    pthread_rwlock_init(&analyzer->lock, NULL);
+    return analyzer;
+}
+
+void iot_analyzer_free(IotAnalyzer *analyzer) {
+    if (!analyzer) {
+        return;
+    }
+    pthread_rwlock_destroy(&analyzer->lock);
+    id_set_destroy(&analyzer->seen_ids);
+    stats_table_free(&analyzer->table);
+    device_dict_free(&analyzer->dict);
+    free(analyzer);
+}
+
+// A date is valid when it survives the round trip through a day number.
+static int valid_date(int date) {
+    int year = date / 10000, month = date / 100 % 100, day = date % 100;
+    if (year < 1 || year > 9999 || month < 1 || month > 12 || day < 1) {
+        return 0;
+    }
+    int y, m, d;
+    civil_from_days(days_from_civil(year, month, day), &y, &m, &d);
+    return y == year && m == month && d == day;
+}
+
+static int valid_reading(const IotReading *reading) {
+    return reading->device != NULL && (reading->date == 0 || valid_date(reading->date)) &&
+           reading->time >= 0 && reading->time < 86400;
+}
+
+int iot_ingest_batch(IotAnalyzer *analyzer, const IotReading *readings, int count) {
+    if (!analyzer || count < 0 || (count > 0 && !readings)) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!valid_reading(&readings[i])) {
+            return 0;
+        }
+    }
+
+    pthread_rwlock_wrlock(&analyzer->lock);
+    // Retransmitted ids are skipped as in a command-line run; room for the
+    // whole batch is made up front.
+    int ok = id_set_reserve(&analyzer->seen_ids, analyzer->num_ids + count);
+    for (int i = 0; i < count && ok; i++) {
+        const IotReading *reading = &readings[i];
+        SensorRecord record;
+        if (reading->date == 0) {
+            continue;
+        }
+        if (reading->id >= 0) {
+            if (!id_set_insert(&analyzer->seen_ids, reading->id)) {
+                continue;
+            }
+            analyzer->num_ids++;
+        }
+        record.id = reading->id;
+        record.seq = reading->seq;
+        record.device_id = device_dict_intern(&analyzer->dict, reading->device);
+        record.date = reading->date;
+        record.time = reading->time;
+        memcpy(record.values, reading->values, sizeof(record.values));
+        record.latitude = reading->latitude;
+        record.longitude = reading->longitude;
+        record.valid = (unsigned char)(reading->valid & (((1u << NUM_SENSORS) - 1) | VALID_GEO));
+        if (record.device_id < 0) {
+            ok = 0;
+            break;
+        }
+
+        long long index = stats_table_find_or_add(&analyzer->table, group_key(&analyzer->spec, &record));
+        if (index < 0) {
+            ok = 0;
+            break;
+        }
+        kernels.update_stats(&analyzer->table.entries[index], &record);
+        track_sequence(&analyzer->table.entries[index], &record);
+    }
+    pthread_rwlock_unlock(&analyzer->lock);
+    return ok;
+}
+
+int iot_query(IotAnalyzer *analyzer, const char *device, int year, int month,
+              IotSensorStats stats[IOT_NUM_SENSORS]) {
+    if (!analyzer || !device || !stats || year < 1 || year > 9999 || month < 1 || month > 12) {
+        return 0;
+    }
+    int found = 0;
+    pthread_rwlock_rdlock(&analyzer->lock);
+    int device_id = device_dict_find(&analyzer->dict, device);
+    if (device_id >= 0) {
+        SensorRecord probe;
+        memset(&probe, 0, sizeof(probe));
+        probe.device_id = device_id;
+        probe.date = year * 10000 + month * 100 + 1;
+        long long index = stats_table_find(&analyzer->table, group_key(&analyzer->spec, &probe));
+        if (index >= 0) {
+            sensor_stats_from(&analyzer->table.entries[index], stats);
+            found = 1;
+        }
+    }
+    pthread_rwlock_unlock(&analyzer->lock);
+    return found;
+}
+
+IotSnapshot *iot_snapshot(IotAnalyzer *analyzer) {
+    if (!analyzer) {
+        return NULL;
+    }
+    IotSnapshot *snapshot = (IotSnapshot *)calloc(1, sizeof(IotSnapshot));
+    if (!snapshot) {
+        return NULL;
+    }
+    pthread_rwlock_rdlock(&analyzer->lock);
+    int num_devices = analyzer->dict.count;
+    snapshot->count = analyzer->table.count;
+    snapshot->names = (char (*)[DEVICE_NAME_LENGTH])malloc((num_devices > 0 ? num_devices : 1) * sizeof(*snapshot->names));
+    snapshot->entries = (MonthlyStats *)malloc((snapshot->count > 0 ? snapshot->count : 1) * sizeof(MonthlyStats));
+    if (snapshot->names && snapshot->entries) {
+        memcpy(snapshot->names, analyzer->dict.names, num_devices * sizeof(*snapshot->names));
+        memcpy(snapshot->entries, analyzer->table.entries, snapshot->count * sizeof(MonthlyStats));
+    }
+    pthread_rwlock_unlock(&analyzer->lock);
+
+    if (!snapshot->names || !snapshot->entries) {
+        iot_snapshot_free(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+long long iot_snapshot_count(const IotSnapshot *snapshot) {
+    return snapshot->count;
+}
+
+void iot_snapshot_group(const IotSnapshot *snapshot, long long index, const char **device, int *year,
+                        int *month, IotSensorStats stats[IOT_NUM_SENSORS]) {
+    const MonthlyStats *entry = &snapshot->entries[index];
+    int ordinal = key_bucket(entry->key);
+    *device = snapshot->names[(int)(unsigned)entry->key.lo];
+    *year = ordinal / 12;
+    *month = ordinal % 12 + 1;
+    sensor_stats_from(entry, stats);
+}
+
+void iot_snapshot_free(IotSnapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+    free(snapshot->names);
+    free(snapshot->entries);
+    free(snapshot);
+}
+
+int iot_set_valid_range(const char *spec) {
+    pthread_mutex_lock(&engine_lock);
+    int ok = !engine_bound && parse_range_option(spec);
+    pthread_mutex_unlock(&engine_lock);
+    return ok;
+}
+
+void iot_request_status(void) {
+    atomic_store_explicit(&status_requested, 1, memory_order_relaxed);
+}
+
+// Reports share the status counters and the rejects file, so they run one
+// at a time.
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int run_report(const IotReportOptions *options);
+
+int iot_run_report(const IotReportOptions *options) {
+    if (pthread_mutex_trylock(&report_lock) != 0) {
+        fprintf(stderr, "Another report is already running\n");
+        return 1;
+    }
+    memset(&run_status, 0, sizeof(run_status));
+    run_status.every_seconds = options->status_seconds;
+    int status = run_report(options);
+    pthread_mutex_unlock(&report_lock);
+    return status;
+}
+
+static int run_report(const IotReportOptions *options) {
+    const char *input_filename = options->input_filename ? options->input_filename : "devices.csv";
+    const char *output_filename = "sensor_stats.csv";
+    const char *gaps_filename = "sensor_gaps.csv";
+    const char *quality_filename = "sensor_quality.csv";
+    const char *partial_filename = "sensor_stats_partial.csv";
+    const char *rejects_filename = "sensor_rejects.csv";
+    const char *top_filename = "sensor_top.csv";
+    TopKQuery top_query = {0, 0, STAT_MAX, 0};
+    const char *filter_text = options->filter;
+    const char *ingest_dir = options->ingest_dir;
+    const char *store_dir = options->store_dir;
+    GroupSpec spec = {KEY_DEVICE | KEY_TIME, BUCKET_MONTH, 0.01, "", NULL};
+    int rollup = options->rollup;
+    int sort_by_device = options->sort_by_device;
+    DeviceSegment *segments = NULL;
+    double sample_fraction = options->sample_fraction > 0.0 ? options->sample_fraction : 1.0;
+    unsigned long long sample_seed = options->sample_seed ? options->sample_seed : clock_seed();
+    int progress_seconds = options->progress_seconds;
+    const char *isa_name = options->isa;
+    ProgressControl progress = {0, options->progress_rows};
+    double coverage = 1.0;
+    BlockSample sample = {NULL, 0, 0, 1.0};
+    const char *meta_filename = options->meta_filename;
+    DeviceMeta meta;
+    BatchQuery *queries = NULL;
+    int num_queries = 0;
+
+    if (options->group_by && !parse_group_by_option(options->group_by, &spec)) {
+        fprintf(stderr, "Invalid grouping '%s', expected e.g. device,month or geo:0.01,day\n",
+                options->group_by);
+        return 1;
+    }
+    if (options->top_k > 0) {
+        top_query.k = options->top_k;
+        top_query.ascending = options->bottom;
+        if (!options->top || !parse_top_k_option(options->top, &top_query)) {
+            fprintf(stderr, "Invalid top-k query '%d %s', expected K sensor:max|avg|min\n",
+                    options->top_k, options->top ? options->top : "");
+            return 1;
+        }
+    }
+    
+    if (ingest_dir && store_dir) {
+        fprintf(stderr, "--ingest and --store cannot be combined\n");
+        return 1;
+    }
+    if (options->queries_filename && (ingest_dir || options->interactive)) {
+        fprintf(stderr, "--queries cannot be combined with --ingest or --interactive\n");
+        return 1;
+    }
+    if (store_dir && sample_fraction < 1.0) {
+        fprintf(stderr, "--sample only applies to CSV input\n");
+        return 1;
+    }
+    if ((options->interactive || options->queries_filename) && sample_fraction < 1.0) {
+        fprintf(stderr, "--sample cannot be combined with --interactive or --queries\n");
+        return 1;
+    }
+    if (!filter_text) {
+        // Ingest, interactive and batch mode keep every row by default.
+        filter_text = ingest_dir || options->interactive || options->queries_filename ? "" : "date >= 2024-03";
+    }
+
+    SensorRecord *records = NULL;
+    long long record_count = 0;
+    RowErrors row_errors;
+    long long min_id, max_id;
+    FilterProgram filter;
+    DeviceDict dict;
+
+    if (!bind_kernels(isa_name)) {
+        return 1;
+    }
+    memset(&meta, 0, sizeof(meta));
+    if (meta_filename) {
+        if (!load_device_meta(meta_filename, &meta)) {
+            return 1;
+        }
+        spec.meta = &meta;
+    }
+    if (spec.parts & KEY_META) {
+        for (int i = 0; spec.meta && i < meta.num_attrs; i++) {
+            if (strcmp(meta.attr_names[i], spec.meta_attr) == 0) {
+                meta.key_attr = i;
+            }
+        }
+        if (!spec.meta || meta.key_attr < 0) {
+            fprintf(stderr, "Grouping by unknown metadata attribute '%s'\n", spec.meta_attr);
+            device_meta_free(&meta);
+            return 1;
+        }
+    }
+    if (options->queries_filename && !load_queries(options->queries_filename, meta_filename ? &meta : NULL,
+                                                   &queries, &num_queries)) {
+        device_meta_free(&meta);
+        return 1;
+    }
+
+    if (!filter_compile(&filter, filter_text)) {
+        device_meta_free(&meta);
+        free_queries(queries, num_queries);
+        return 1;
+    }
+    if (!device_dict_init(&dict)) {
+        perror("Memory allocation failed");
+        filter_free(&filter);
+        device_meta_free(&meta);
+        free_queries(queries, num_queries);
+        return 1;
+    }
+    
+    remove(rejects_filename);     // only rewritten when rows are rejected
+    pthread_t reporter;
+    if (options->status_seconds > 0 || options->status_requests) {
+        run_status.running = pthread_create(&reporter, NULL, report_status, &run_status) == 0;
+    }
+
+    int loaded = store_dir
+        ? read_store(store_dir, &filter, &dict, &records, &record_count, &min_id, &max_id, &row_errors)
+        : sample_fraction < 1.0
+        ? read_csv_sampled(input_filename, sample_fraction, sample_seed, &filter, &dict, &records,
+                           &record_count, &min_id, &max_id, &row_errors, rejects_filename, &coverage,
+                           &sample)
+        : read_csv(input_filename, &filter, &dict, &records, &record_count, &min_id, &max_id,
+                   &row_errors, rejects_filename);
+    if (!loaded) {
+        stop_status_reporter(reporter);
+        filter_free(&filter);
+        device_dict_free(&dict);
+        device_meta_free(&meta);
+        free_queries(queries, num_queries);
+        return 1;
+    }
+    filter_free(&filter);
+    long long rejected = row_errors.malformed + row_errors.corrupt + row_errors.overlong;
+    if (rejected > 0 && row_errors.unsaved) {
+        fprintf(stderr, "Rejected %lld rows (%lld malformed, %lld corrupt, %lld overlong), but %s is incomplete\n",
+                rejected, row_errors.malformed, row_errors.corrupt, row_errors.overlong, rejects_filename);
+    } else if (rejected > 0) {
+        printf("Quarantined %lld rows (%lld malformed, %lld corrupt, %lld overlong) to %s\n",
+               rejected, row_errors.malformed, row_errors.corrupt, row_errors.overlong, rejects_filename);
+    }
+    
+    if (record_count == 0) {
+        printf("No records match the filter.\n");
+        stop_status_reporter(reporter);
+        free(records);
+        device_dict_free(&dict);
+        device_meta_free(&meta);
+        free_queries(queries, num_queries);
+        return 0;
+    }
+    if (ingest_dir) {
+        int stored = write_store(ingest_dir, records, record_count, &dict);
+        stop_status_reporter(reporter);
+        device_dict_free(&dict);
+        device_meta_free(&meta);
+        free_queries(queries, num_queries);
+        return !stored;
+    }
+    if (spec.meta && !device_meta_bind(&meta, &dict)) {
+        perror("Memory allocation failed");
+        stop_status_reporter(reporter);
+        free(records);
+        device_dict_free(&dict);
+        device_meta_free(&meta);
+        free_queries(queries, num_queries);
+        return 1;
+    }
+    // The intervals of a sampled run revisit its rows block by block, so
+    // duplicates go first and both passes see the same rows.
+    long long duplicates = coverage < 1.0 ? drop_duplicates(records, &record_count, min_id, max_id) : 0;
+    if (duplicates < 0) {
+        stop_status_reporter(reporter);
+        free(records);
+        device_dict_free(&dict);
+        device_meta_free(&meta);
+        return 1;
+    }
+    if (sort_by_device) {
+        atomic_store_explicit(&run_status.phase, PHASE_SORTING, memory_order_relaxed);
+        if (!sort_records_by_device(&records, record_count, dict.count, &segments)) {
+            stop_status_reporter(reporter);
+            free(records);
+            device_dict_free(&dict);
+            device_meta_free(&meta);
+            free_queries(queries, num_queries);
+            return 1;
+        }
+    }
+    if (queries) {
+        duplicates = drop_duplicates(records, &record_count, min_id, max_id);
+        if (duplicates > 0) {
+            printf("Skipped %lld duplicate records\n", duplicates);
+        }
+        atomic_store_explicit(&run_status.phase, PHASE_AGGREGATING, memory_order_relaxed);
+        int ok = duplicates >= 0 && prepare_queries(queries, num_queries, &meta, &dict) &&
+                 run_shared_scan(records, record_count, queries, num_queries, &dict);
+        stop_status_reporter(reporter);
+        if (!ok && duplicates >= 0) {
+            perror("Memory allocation failed");
+        }
+        free(records);
+        free(segments);
+        free_queries(queries, num_queries);
+        device_dict_free(&dict);
+        device_meta_free(&meta);
+        return !ok;
+    }
+    if (options->interactive) {
+        stop_status_reporter(reporter);
+        duplicates = drop_duplicates(records, &record_count, min_id, max_id);
+        if (duplicates > 0) {
+            fprintf(stderr, "Skipped %lld duplicate records\n", duplicates);
+        }
+        int ok = duplicates >= 0 && run_interactive(records, record_count, &dict, &meta, spec);
+        free(records);
+        free(segments);
+        device_dict_free(&dict);
+        device_meta_free(&meta);
+        return !ok;
+    }
+    
+
+    int num_threads = get_cpu_count();
+    if (num_threads > record_count) {
+        num_threads = (int)record_count;
+    }
+    
+    IdSet seen_ids;
+    if (!id_set_init(&seen_ids, min_id, max_id, record_count)) {
+        perror("Not enough memory for duplicate detection");
+        stop_status_reporter(reporter);
+        free(records);
+        free(segments);
+        device_dict_free(&dict);
+        device_meta_free(&meta);
+        return 1;
+    }
+
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    ThreadData *thread_data = (ThreadData *)malloc(num_threads * sizeof(ThreadData));
+    
+    
+    long long records_per_thread = record_count / num_threads;
+    long long remaining_records = record_count % num_threads;
+    long long start = 0;
+    int progressive = progress_seconds > 0 || progress.every_rows > 0;
+    if (progress.every_rows > 0) {
+        // Each worker publishes its share of the interval.
+        progress.every_rows = (progress.every_rows + num_threads - 1) / num_threads;
+    }
+    run_status.workers = thread_data;
+    run_status.records_total = record_count;
+    atomic_store_explicit(&run_status.phase, PHASE_AGGREGATING, memory_order_relaxed);
+    
+    for (int i = 0; i < num_threads; i++) {
+        thread_data[i].records = records;
+        thread_data[i].start = start;
+        thread_data[i].end = start + records_per_thread + (i < remaining_records ? 1 : 0);
+        if (segments && thread_data[i].end > start && thread_data[i].end < record_count) {
+            // Keep each device in one worker so its readings are seen in order.
+            const DeviceSegment *segment = &segments[records[thread_data[i].end - 1].device_id];
+            thread_data[i].end = segment->start + segment->count;
+        }
+        if (i == num_threads - 1 || thread_data[i].end > record_count) {
+            thread_data[i].end = record_count;
+        }
+        thread_data[i].spec = &spec;
+        thread_data[i].seen_ids = &seen_ids;
+        thread_data[i].duplicates = 0;
+        thread_data[i].failed = !stats_table_init(&thread_data[i].table);
+        thread_data[i].progress = progressive ? &progress : NULL;
+        atomic_init(&thread_data[i].published, NULL);
+        atomic_init(&thread_data[i].done, 0);
+        atomic_init(&thread_data[i].processed, 0LL);
+        
+        start = thread_data[i].end;
+        
+        pthread_create(&threads[i], NULL, process_records, &thread_data[i]);
+    }
+    
+   
+    atomic_store_explicit(&run_status.num_workers, num_threads, memory_order_release);
+
+    int failed = 0;
+    if (progressive) {
+        watch_progress(thread_data, num_threads, record_count, coverage, &progress,
+                                 progress_seconds, &spec, &dict, partial_filename);
+    }
+
+    // Each worker aggregated into its own table; fold them into the first.
+    StatsTable *table = &thread_data[0].table;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        duplicates += thread_data[i].duplicates;
+        failed |= thread_data[i].failed;
+        if (i > 0 && !failed) {
+            failed = !stats_table_merge(table, &thread_data[i].table);
+        }
+    }
+    stop_status_reporter(reporter);
+    if (duplicates > 0) {
+        printf("Skipped %lld duplicate records\n", duplicates);
+    }
+    
+    
+    double *intervals = NULL;
+    sample.records = records;
+    sample.count = record_count;
+    if (!failed && coverage < 1.0 && !(intervals = block_intervals(table, &spec, spec.parts, &sample))) {
+        failed = 1;
+    }
+    if (failed) {
+        perror("Memory allocation failed");
+    } else {
+        write_results_to_csv(table->entries, table->count, &spec, &dict, coverage, intervals, output_filename);
+        free(intervals);
+        printf("Results written to %s\n", output_filename);
+        // Sampling leaves holes in every counter range, so gaps are only
+        // meaningful on a full scan.
+        if (coverage < 1.0) {
+            printf("Estimated from %.1f%% of the input (seed %llu)\n", coverage * 100.0, sample_seed);
+        } else if (!(spec.parts & KEY_DEVICE)) {
+            // Counters are per device; merged across devices their range
+            // and count say nothing about loss.
+            remove(gaps_filename);
+            printf("Sequence gaps skipped, the grouping has no device\n");
+        } else {
+            // Sorted by device, each device's readings are one run in a
+            // single worker, so its counters are compared in timestamp order.
+            write_gaps_to_csv(table->entries, table->count, &spec, &dict, sort_by_device, gaps_filename);
+            printf("Sequence gaps written to %s\n", gaps_filename);
+        }
+        write_quality_to_csv(table->entries, table->count, &spec, &dict, quality_filename);
+        printf("Data quality written to %s\n", quality_filename);
+        if (top_query.k > 0) {
+            write_top_k_to_csv(table->entries, table->count, &spec, &dict, &top_query,
+                               num_threads, top_filename);
+            printf("Top %d per time bucket written to %s\n", top_query.k, top_filename);
+        }
+        if (rollup && !write_rollups_to_csv(table, &spec, &dict, coverage, coverage < 1.0 ? &sample : NULL,
+                                         "sensor_stats")) {
+            failed = 1;
+        }
+    }
+    
+   
+    free(records);
+    free(segments);
+    free(threads);
+    for (int i = 0; i < num_threads; i++) {
+        stats_table_free(&thread_data[i].table);
+    }
+    free(thread_data);
+    id_set_destroy(&seen_ids);
+    device_dict_free(&dict);
+    device_meta_free(&meta);
+    
+    return failed;
+}
\ No newline at end of file
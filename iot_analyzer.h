@@ -0,0 +1,100 @@
+#ifndef IOT_ANALYZER_H
+#define IOT_ANALYZER_H
+
+#define IOT_NUM_SENSORS 6          // temperatura, umidade, luminosidade, ruido, eco2, etvoc
+#define IOT_VALID_GEO (1u << IOT_NUM_SENSORS)
+
+// One reading handed to iot_ingest_batch.
+typedef struct {
+    long long id;              // -1 when unknown
+    long long seq;             // contagem, -1 when unknown
+    const char *device;        // at most 49 bytes are kept
+    int date;                  // YYYYMMDD, 0 when unknown
+    int time;                  // seconds since midnight
+    double values[IOT_NUM_SENSORS];
+    double latitude;
+    double longitude;
+    unsigned int valid;        // bit i set when values[i] is present, IOT_VALID_GEO for coordinates
+} IotReading;
+
+// Statistics of one sensor in one device and month. Readings outside the
+// valid range are only counted.
+typedef struct {
+    long long count;
+    long long out_of_range;
+    double min;
+    double max;
+    double mean;
+} IotSensorStats;
+
+// An analyzer aggregates ingested readings per device and month. Every
+// function may be called from any thread; ingests are serialised against
+// each other and queries run alongside each other.
+typedef struct IotAnalyzer IotAnalyzer;
+
+// An immutable copy of an analyzer's groups, unaffected by later ingests.
+typedef struct IotSnapshot IotSnapshot;
+
+IotAnalyzer *iot_analyzer_create(void);
+void iot_analyzer_free(IotAnalyzer *analyzer);
+
+// Adds `count` readings. Readings without a date are ignored, and so is a
+// reading whose id (when not -1) was already ingested, as in a command-line
+// run. Returns 0 without adding anything when a reading has no device, an
+// impossible date or a time outside the day, and returns 0 when out of
+// memory, in which case a prefix of the batch may have been added.
+int iot_ingest_batch(IotAnalyzer *analyzer, const IotReading *readings, int count);
+
+// Fills stats[] for one device and month (1-12) and returns 1, or returns 0
+// when nothing was ingested for them or the arguments are invalid.
+int iot_query(IotAnalyzer *analyzer, const char *device, int year, int month,
+              IotSensorStats stats[IOT_NUM_SENSORS]);
+
+// Returns NULL when out of memory or `analyzer` is NULL.
+IotSnapshot *iot_snapshot(IotAnalyzer *analyzer);
+long long iot_snapshot_count(const IotSnapshot *snapshot);
+void iot_snapshot_group(const IotSnapshot *snapshot, long long index, const char **device, int *year,
+                        int *month, IotSensorStats stats[IOT_NUM_SENSORS]);
+void iot_snapshot_free(IotSnapshot *snapshot);
+
+// Sets the valid range of a sensor from "sensor=min:max", for every
+// analyzer and report in the process. The ranges and the kernel variant are
+// fixed by the first analyzer or report, so this returns 0 afterwards, and
+// also when the text is malformed or min exceeds max.
+int iot_set_valid_range(const char *spec);
+
+// Settings of a command-line report; zero means the default for every
+// field. A sample_fraction of 1 or more reads the whole input.
+typedef struct {
+    const char *input_filename;    // devices.csv
+    const char *filter;            // "date >= 2024-03", or every row when ingesting
+    const char *group_by;          // "device,month"
+    const char *meta_filename;
+    const char *ingest_dir;
+    const char *store_dir;
+    const char *isa;
+    int top_k;                     // with `top` as "sensor:max|avg|min"
+    const char *top;
+    int bottom;                    // rank the lowest values first
+    int rollup;
+    int sort_by_device;
+    int interactive;               // answer queries from stdin instead of writing the report
+    const char *queries_filename;  // evaluate the queries listed in this file in one scan instead
+    double sample_fraction;
+    unsigned long long sample_seed;  // picks the sampled blocks; 0 for a new seed every run
+    int progress_seconds;
+    long long progress_rows;
+    int status_seconds;
+    int status_requests;           // print the status whenever iot_request_status is called
+} IotReportOptions;
+
+// Runs the report the command line describes, writing the CSV outputs.
+// Only one report runs at a time; a concurrent call fails. `isa` must match
+// the kernels already bound, if any. Returns the process exit status.
+int iot_run_report(const IotReportOptions *options);
+
+// Asks the running report to print its status to stderr. Safe to call from
+// a signal handler.
+void iot_request_status(void);
+
+#endif
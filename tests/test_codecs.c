@@ -0,0 +1,284 @@
+// The segment codecs: integer columns through delta-of-delta coding and
+// float columns through XOR coding come back bit for bit, including a short
+// final block, every step size class, extreme values, NaN and infinities,
+// and bit-packed device codes load back as the right devices at every code
+// width.
+// Built from the analyzer source so the static functions are reachable:
+//
+//     gcc -O2 -o test_codecs tests/test_codecs.c -lpthread -lm && ./test_codecs
+#include "../iot_analyzer.c"
+#include <float.h>
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+// Two full blocks and a partial one.
+#define ROWS (2 * SEGMENT_BLOCK + 123)
+
+static unsigned long long random_state = 0x9E3779B97F4A7C15ULL;
+
+static unsigned long long random_bits(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+// Writes `rows` values as a compressed column, reads the file back and
+// decodes it a block at a time as load_segment does. Returns the decoded
+// values, or NULL after reporting a failure.
+static void *round_trip(const char *name, const void *values, long long rows, int floats) {
+    FILE *file = tmpfile();
+    long long offset = -1;
+    if (!file || !write_packed_column(file, values, rows, floats, &offset)) {
+        CHECK(0, "%s: writing the column failed", name);
+        if (file) {
+            fclose(file);
+        }
+        return NULL;
+    }
+    long long size = ftell(file);
+    char *column = (char *)malloc(size > 0 ? size : 1);
+    rewind(file);
+    CHECK(offset == 0 && fread(column, 1, size, file) == (size_t)size, "%s: reading the column failed", name);
+    fclose(file);
+
+    long long *decoded = (long long *)malloc((rows > 0 ? rows : 1) * sizeof(long long));
+    for (long long first = 0; first < rows; first += SEGMENT_BLOCK) {
+        int n = rows - first < SEGMENT_BLOCK ? (int)(rows - first) : SEGMENT_BLOCK;
+        CHECK(decode_packed_block(column, size, first / SEGMENT_BLOCK, n, floats, decoded + first),
+              "%s: block %lld reported damaged", name, first / SEGMENT_BLOCK);
+    }
+    free(column);
+    return decoded;
+}
+
+static void check_longs(const char *name, const long long *values, long long rows) {
+    long long *decoded = (long long *)round_trip(name, values, rows, 0);
+    for (long long i = 0; decoded && i < rows; i++) {
+        if (decoded[i] != values[i]) {
+            CHECK(0, "%s: row %lld decoded as %lld, expected %lld", name, i, decoded[i], values[i]);
+            break;
+        }
+    }
+    free(decoded);
+}
+
+// Compares bit patterns, so NaN payloads and the sign of zero count.
+static void check_doubles(const char *name, const double *values, long long rows) {
+    double *decoded = (double *)round_trip(name, values, rows, 1);
+    for (long long i = 0; decoded && i < rows; i++) {
+        if (memcmp(&decoded[i], &values[i], sizeof(double)) != 0) {
+            CHECK(0, "%s: row %lld decoded as %g, expected %g", name, i, decoded[i], values[i]);
+            break;
+        }
+    }
+    free(decoded);
+}
+
+static void test_deltas(void) {
+    static long long values[ROWS];
+
+    // A counter and a timestamp that advance steadily, at the sizes where a
+    // column ends exactly on a block, one row after it and one row before.
+    for (long long i = 0; i < ROWS; i++) {
+        values[i] = 20240101LL * 86400 + i * 30;
+    }
+    check_longs("steady", values, ROWS);
+    check_longs("one row", values, 1);
+    check_longs("full block", values, SEGMENT_BLOCK);
+    check_longs("block and a row", values, SEGMENT_BLOCK + 1);
+    check_longs("block less a row", values, SEGMENT_BLOCK - 1);
+
+    // Every step change on both sides of each prefix class boundary.
+    static const long long changes[] = {
+        1, -1, 63, -64, 64, -65, 255, -256, 256, -257, 2047, -2048, 2048, -2049,
+        INT_MAX, INT_MIN, (long long)INT_MAX + 1, (long long)INT_MIN - 1, LLONG_MAX / 4, LLONG_MIN / 4
+    };
+    int num_changes = sizeof(changes) / sizeof(changes[0]);
+    long long delta = 0;
+    values[0] = 0;
+    for (long long i = 1; i < ROWS; i++) {
+        // Undo the change every other row so the steps stay bounded.
+        long long change = changes[(i / 2) % num_changes];
+        delta += i % 2 ? change : -change;
+        values[i] = (long long)((unsigned long long)values[i - 1] + (unsigned long long)delta);
+    }
+    check_longs("class boundaries", values, ROWS);
+
+    // Steps that overflow: jumps between the ends of the range and -1 ids.
+    for (long long i = 0; i < ROWS; i++) {
+        switch (i % 5) {
+            case 0: values[i] = LLONG_MAX; break;
+            case 1: values[i] = LLONG_MIN; break;
+            case 2: values[i] = -1; break;
+            case 3: values[i] = 0; break;
+            default: values[i] = LLONG_MAX - 1; break;
+        }
+    }
+    check_longs("extremes", values, ROWS);
+
+    for (long long i = 0; i < ROWS; i++) {
+        values[i] = (long long)random_bits();
+    }
+    check_longs("random", values, ROWS);
+}
+
+static void test_xor(void) {
+    static double values[ROWS];
+    double quiet_nan, negative_nan, payload_nan;
+    unsigned long long bits = 0x7FF8000000000000ULL;
+    memcpy(&quiet_nan, &bits, sizeof(bits));
+    bits = 0xFFF8000000000000ULL;
+    memcpy(&negative_nan, &bits, sizeof(bits));
+    bits = 0x7FF0000000000001ULL;
+    memcpy(&payload_nan, &bits, sizeof(bits));
+
+    // Readings drifting slowly and repeating, as from a real sensor.
+    for (long long i = 0; i < ROWS; i++) {
+        values[i] = 21.5 + (i / 7) * 0.1;
+    }
+    check_doubles("drift", values, ROWS);
+    check_doubles("one row", values, 1);
+    check_doubles("block and a row", values, SEGMENT_BLOCK + 1);
+
+    // Specials between ordinary readings, and signs that flip every row.
+    static const double specials[] = {
+        0.0, -0.0, 1.0, -1.0, INFINITY, -INFINITY, DBL_MAX, -DBL_MAX, DBL_MIN, -DBL_MIN, 4.9e-324, 23.75
+    };
+    int num_specials = sizeof(specials) / sizeof(specials[0]);
+    for (long long i = 0; i < ROWS; i++) {
+        switch (i % 17) {
+            case 3: values[i] = quiet_nan; break;
+            case 4: values[i] = quiet_nan; break;
+            case 9: values[i] = negative_nan; break;
+            case 13: values[i] = payload_nan; break;
+            default: values[i] = specials[i % num_specials]; break;
+        }
+    }
+    check_doubles("specials", values, ROWS);
+    for (long long i = 0; i < ROWS; i++) {
+        values[i] = (i % 2 ? -1 : 1) * (18.0 + (i % 40) * 0.25);
+    }
+    check_doubles("sign changes", values, ROWS);
+
+    // Random bit patterns need the widest encoding of every value.
+    for (long long i = 0; i < ROWS; i++) {
+        bits = random_bits();
+        memcpy(&values[i], &bits, sizeof(bits));
+    }
+    check_doubles("random bits", values, ROWS);
+}
+
+// Writes `rows` records spread over `num_devices` devices as a segment,
+// loads it back into a fresh dictionary and compares every record.
+static void check_devices(int num_devices, long long rows) {
+    char path[64];
+    DeviceDict dict, loaded;
+    FilterProgram filter;
+    device_dict_init(&dict);
+    device_dict_init(&loaded);
+    filter.length = 0;
+    snprintf(path, sizeof(path), "test_codecs_%d.seg", num_devices);
+
+    // Every device shows up, codes are handed out in a scrambled order and
+    // the last row uses the highest code.
+    SensorRecord *records = (SensorRecord *)calloc(rows, sizeof(SensorRecord));
+    long long *order = (long long *)malloc(rows * sizeof(long long));
+    int *codes = (int *)malloc(num_devices * sizeof(int));
+    void *buffer = malloc(rows * sizeof(double) + DEVICE_NAME_LENGTH * (size_t)num_devices);
+    for (int d = 0; d < num_devices; d++) {
+        char name[DEVICE_NAME_LENGTH];
+        snprintf(name, sizeof(name), "dev_%d", (d * 7919) % num_devices);
+        device_dict_intern(&dict, name);
+        codes[d] = -1;
+    }
+    for (long long i = 0; i < rows; i++) {
+        records[i].id = i;
+        records[i].seq = -1;
+        records[i].device_id = i < num_devices ? (int)i : (int)(random_bits() % num_devices);
+        records[i].date = 20240315;
+        records[i].time = (int)(i % 86400);
+        records[i].valid = 1;
+        records[i].values[0] = i;
+        order[i] = i;
+    }
+    records[rows - 1].device_id = num_devices - 1;
+
+    ManifestEntry entry;
+    MappedFile mapped;
+    SegmentFooter footer;
+    Loader loader;
+    SensorRecord *back = NULL;
+    long long count = 0, min_id, max_id;
+    RowErrors errors;
+    CHECK(write_segment(path, records, order, rows, &dict, codes, buffer, &entry),
+          "%d devices: writing the segment failed", num_devices);
+    if (open_segment(path, &mapped, &footer)) {
+        long long bits;
+        memcpy(&bits, mapped.data + footer.offsets[COLUMN_DEVICE], sizeof(bits));
+        CHECK(footer.num_devices == num_devices && bits == code_bits(num_devices),
+              "%d devices: the segment holds %d devices in %lld bits", num_devices, footer.num_devices, bits);
+        loader_init(&loader, &filter, &loaded, NULL, NULL);
+        loader.capacity = rows;
+        loader.records = (SensorRecord *)malloc(rows * sizeof(SensorRecord));
+        CHECK(load_segment(&loader, &mapped, &footer) == 1, "%d devices: loading the segment failed", num_devices);
+        unmap_file(&mapped);
+        loader_finish(&loader, 1, &back, &count, &min_id, &max_id, &errors);
+    } else {
+        CHECK(0, "%d devices: the segment does not open", num_devices);
+    }
+
+    CHECK(count == rows && loaded.count == num_devices, "%d devices: loaded %lld rows of %d devices",
+          num_devices, count, loaded.count);
+    for (long long i = 0; back && count == rows && i < rows; i++) {
+        const char *wanted = dict.names[records[i].device_id];
+        if (strcmp(loaded.names[back[i].device_id], wanted) != 0 || back[i].id != i) {
+            CHECK(0, "%d devices: row %lld loaded as %s, expected %s", num_devices, i,
+                  loaded.names[back[i].device_id], wanted);
+            break;
+        }
+    }
+    for (int d = 0; d < num_devices; d++) {
+        CHECK(codes[d] == -1, "%d devices: write_segment left code %d set", num_devices, d);
+    }
+    remove(path);
+    free(back);
+    free(records);
+    free(order);
+    free(codes);
+    free(buffer);
+    device_dict_free(&dict);
+    device_dict_free(&loaded);
+}
+
+// A single device needs no code bits at all; otherwise the width steps up
+// one past each power of two.
+static void test_device_codes(void) {
+    static const int widths[][2] = {
+        {1, 0}, {2, 1}, {3, 2}, {4, 2}, {5, 3}, {8, 3}, {9, 4}, {256, 8}, {257, 9}, {65536, 16}, {65537, 17}
+    };
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        int num_devices = widths[w][0];
+        CHECK(code_bits(num_devices) == widths[w][1], "code_bits(%d) is %d, expected %d", num_devices,
+              code_bits(num_devices), widths[w][1]);
+        check_devices(num_devices, num_devices > ROWS ? num_devices + 123 : ROWS);
+    }
+    check_devices(1, 1);
+}
+
+int main(void) {
+    test_deltas();
+    test_xor();
+    test_device_codes();
+    printf("codecs: %s\n", failures == 0 ? "ok" : "FAILED");
+    return failures != 0;
+}
@@ -0,0 +1,263 @@
+// Counts past 2^31 rows: a single group aggregates more rows than an int
+// holds, and the counters survive merging and reach the CSV outputs intact.
+// A generated CSV is also streamed through the parser, the partitioning and
+// process_records; by default it is a few million rows, and passing a row
+// count runs it at that size, e.g. past 2^31 rows (about six minutes per
+// billion rows on one core). Built from the analyzer source so the static
+// functions are reachable:
+//
+//     gcc -O2 -o test_counts tests/test_counts.c -lpthread -lm && ./test_counts [rows]
+#include "../iot_analyzer.c"
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+#define PAST_INT_MAX ((long long)INT_MAX + 1 + MAX_RUN)
+
+// Reduces a run of MAX_RUN readings with the bound run kernel and merges it
+// into one group until the group holds PAST_INT_MAX rows, as process_records
+// does for a long stream of one device and month.
+static void test_aggregate_past_int_max(void) {
+    SensorRecord *records = (SensorRecord *)calloc(MAX_RUN, sizeof(SensorRecord));
+    double values[NUM_SENSORS];
+    MonthlyStats run, stats;
+    GroupKey key = {0, 0};
+    for (int j = 0; j < NUM_SENSORS; j++) {
+        // The lower bound is inside the valid range.
+        values[j] = isfinite(sensor_min_valid[j]) ? sensor_min_valid[j] : 1.0;
+    }
+    for (int i = 0; i < MAX_RUN; i++) {
+        records[i].date = 20240101;
+        records[i].valid = (1u << NUM_SENSORS) - 1;
+        memcpy(records[i].values, values, sizeof(values));
+    }
+    initialize_stats(&run, key);
+    kernels.update_run(&run, records, MAX_RUN);
+    CHECK(run.rows == MAX_RUN, "run rows %lld, expected %d", run.rows, MAX_RUN);
+
+    initialize_stats(&stats, key);
+    long long fed = 0;
+    while (fed < PAST_INT_MAX) {
+        merge_stats(&stats, &run);
+        fed += MAX_RUN;
+    }
+    CHECK(stats.rows == fed, "rows %lld, expected %lld", stats.rows, fed);
+    for (int j = 0; j < NUM_SENSORS; j++) {
+        CHECK(stats.count[j] == fed, "%s count %lld, expected %lld", sensor_names[j], stats.count[j], fed);
+        CHECK(stats.sum[j] == values[j] * fed, "%s sum %.1f, expected %.1f", sensor_names[j], stats.sum[j],
+              values[j] * fed);
+    }
+    free(records);
+}
+
+// Two partitions just under INT_MAX each merge into one past it, and the
+// quality and gap files print the full 64-bit values.
+static void test_merge_and_write(void) {
+    MonthlyStats parts[2];
+    GroupKey key = {0, 0};
+    for (int p = 0; p < 2; p++) {
+        initialize_stats(&parts[p], key);
+        parts[p].rows = INT_MAX - 1;
+        for (int j = 0; j < NUM_SENSORS; j++) {
+            parts[p].count[j] = INT_MAX - 1;
+        }
+        // Counters above 2^32 with a gap of one between the partitions.
+        parts[p].seq_min = 5000000000LL + p * (long long)INT_MAX;
+        parts[p].seq_max = parts[p].seq_min + INT_MAX - 2;
+        parts[p].seq_last = parts[p].seq_max;
+        parts[p].seq_received = INT_MAX - 1;
+    }
+    merge_stats(&parts[0], &parts[1]);
+    long long expected = 2LL * (INT_MAX - 1);
+    CHECK(parts[0].rows == expected, "merged rows %lld, expected %lld", parts[0].rows, expected);
+    CHECK(parts[0].seq_received == expected, "merged received %lld", parts[0].seq_received);
+
+    GroupSpec spec = {0, BUCKET_NONE, 0.01, "", NULL};
+    DeviceDict dict;
+    device_dict_init(&dict);
+    char line[256];
+    char wanted[256];
+
+    write_quality_to_csv(parts, 1, &spec, &dict, "test_counts_quality.csv");
+    FILE *file = fopen("test_counts_quality.csv", "r");
+    CHECK(file && fgets(line, sizeof(line), file) && fgets(line, sizeof(line), file),
+          "cannot read test_counts_quality.csv");
+    snprintf(wanted, sizeof(wanted), "%s;%lld;0;0\n", sensor_names[0], expected);
+    CHECK(strcmp(line, wanted) == 0, "quality line '%s', expected '%s'", line, wanted);
+    if (file) {
+        fclose(file);
+    }
+
+    write_gaps_to_csv(parts, 1, &spec, &dict, 1, "test_counts_gaps.csv");
+    file = fopen("test_counts_gaps.csv", "r");
+    CHECK(file && fgets(line, sizeof(line), file) && fgets(line, sizeof(line), file),
+          "cannot read test_counts_gaps.csv");
+    long long range = parts[0].seq_max - parts[0].seq_min + 1;
+    snprintf(wanted, sizeof(wanted), "%lld;%lld;%lld;", expected, range, range - expected);
+    CHECK(strncmp(line, wanted, strlen(wanted)) == 0, "gaps line '%s', expected it to start with '%s'", line, wanted);
+    if (file) {
+        fclose(file);
+    }
+
+    remove("test_counts_quality.csv");
+    remove("test_counts_gaps.csv");
+    device_dict_free(&dict);
+}
+
+#define CHUNK_LINES 100000
+#define STREAM_WORKERS 4
+#define DEFAULT_STREAM_ROWS (40LL * CHUNK_LINES)
+
+// Writes `value` as `width` zero-padded digits, without a terminator.
+static void put_digits(char *at, int width, long long value) {
+    for (int d = width - 1; d >= 0; d--) {
+        at[d] = (char)('0' + value % 10);
+        value /= 10;
+    }
+}
+
+// Streams `rows` generated lines, CHUNK_LINES at a time, through load_lines
+// and process_records on STREAM_WORKERS workers, whose tables live across
+// chunks as they would over one huge input. Grouped by month alone, every
+// line lands in one group, so its counters pass 2^31 once the stream does;
+// the device alternates every 1000 lines, which ends the runs the kernels
+// reduce. Ids and contagem count up over the whole stream; only their
+// digits are rewritten between chunks.
+static void test_stream(long long rows) {
+    long long chunks = (rows + CHUNK_LINES - 1) / CHUNK_LINES;
+    rows = chunks * CHUNK_LINES;
+    char line[128];
+    int length = snprintf(line, sizeof(line), "%012d|dev_0|%012d|2024-03-15 12:00:00.000|21.50|55.00|"
+                          "100|40|500|100|-29.100000|-51.100000\n", 0, 0);
+    const int seq_offset = 12 + 1 + 5 + 1;  // after the id and the device
+    char *text = (char *)malloc((size_t)CHUNK_LINES * length);
+    for (int i = 0; i < CHUNK_LINES; i++) {
+        char *at = text + (size_t)i * length;
+        memcpy(at, line, length);
+        at[17] = (char)('0' + (i / 1000) % 2);  // dev_0 or dev_1
+    }
+
+    DeviceDict dict;
+    FilterProgram filter;
+    GroupSpec spec;
+    IdSet seen_ids;
+    Loader loader;
+    ThreadData data[STREAM_WORKERS];
+    pthread_t threads[STREAM_WORKERS];
+    device_dict_init(&dict);
+    filter.length = 0;
+    memset(&spec, 0, sizeof(spec));
+    parse_group_by_option("month", &spec);
+    int failed = !id_set_init(&seen_ids, 0, rows - 1, rows);
+    CHECK(!failed, "no memory for %lld ids", rows);
+    loader_init(&loader, &filter, &dict, text, NULL);
+    loader.capacity = CHUNK_LINES;
+    loader.records = (SensorRecord *)malloc(CHUNK_LINES * sizeof(SensorRecord));
+    memset(data, 0, sizeof(data));
+    for (int t = 0; t < STREAM_WORKERS; t++) {
+        data[t].spec = &spec;
+        data[t].seen_ids = &seen_ids;
+        data[t].failed = !stats_table_init(&data[t].table);
+    }
+
+    long long loaded = 0;
+    for (long long c = 0; c < chunks && !failed; c++) {
+        for (int i = 0; i < CHUNK_LINES; i++) {
+            char *at = text + (size_t)i * length;
+            put_digits(at, 12, c * CHUNK_LINES + i);
+            put_digits(at + seq_offset, 12, c * CHUNK_LINES + i);
+        }
+        loader.kept = 0;
+        failed = !load_lines(&loader, text, text + (size_t)CHUNK_LINES * length, text + (size_t)CHUNK_LINES * length) ||
+                 !loader_flush(&loader) || loader.kept != CHUNK_LINES;
+        CHECK(!failed, "chunk %lld parsed %lld lines", c, loader.kept);
+        loaded += loader.kept;
+
+        long long per_worker = loader.kept / STREAM_WORKERS;
+        long long remaining = loader.kept % STREAM_WORKERS;
+        long long start = 0;
+        for (int t = 0; t < STREAM_WORKERS; t++) {
+            data[t].records = loader.records;
+            data[t].start = start;
+            data[t].end = start + per_worker + (t < remaining ? 1 : 0);
+            start = data[t].end;
+            pthread_create(&threads[t], NULL, process_records, &data[t]);
+        }
+        for (int t = 0; t < STREAM_WORKERS; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    long long duplicates = 0;
+    StatsTable *table = &data[0].table;
+    for (int t = 0; t < STREAM_WORKERS; t++) {
+        duplicates += data[t].duplicates;
+        failed |= data[t].failed;
+        if (t > 0 && !failed) {
+            failed = !stats_table_merge(table, &data[t].table);
+        }
+    }
+    CHECK(!failed, "aggregation failed");
+    CHECK(loaded == rows && loader.parsed == rows, "parsed %lld and kept %lld of %lld rows", loader.parsed, loaded,
+          rows);
+    CHECK(duplicates == 0, "%lld duplicates in distinct ids", duplicates);
+    CHECK(loader.min_id == 0 && loader.max_id == rows - 1, "ids %lld..%lld, expected 0..%lld", loader.min_id,
+          loader.max_id, rows - 1);
+    CHECK(table->count == 1 && dict.count == 2, "%lld groups of %d devices, expected 1 of 2", table->count,
+          dict.count);
+    failed |= table->count != 1;
+    long long expected = rows;
+    const MonthlyStats *stats = &table->entries[0];
+    CHECK(failed || (stats->rows == expected && stats->seq_received == expected &&
+                     stats->seq_min == 0 && stats->seq_max == rows - 1),
+          "%lld rows, %lld counters from %lld to %lld, expected %lld", stats->rows, stats->seq_received,
+          stats->seq_min, stats->seq_max, expected);
+    for (int j = 0; !failed && j < NUM_SENSORS; j++) {
+        CHECK(stats->count[j] == expected, "%s: %lld readings, expected %lld", sensor_names[j], stats->count[j],
+              expected);
+    }
+    CHECK(failed || stats->sum[0] == 21.5 * expected, "temperature sum %.1f, expected %.1f", stats->sum[0],
+          21.5 * expected);
+
+    // The report prints the full count.
+    write_quality_to_csv(table->entries, table->count, &spec, &dict, "test_counts_stream.csv");
+    FILE *file = fopen("test_counts_stream.csv", "r");
+    char text_line[256];
+    char wanted[64];
+    snprintf(wanted, sizeof(wanted), ";%s;%lld;0;0\n", sensor_names[0], expected);
+    CHECK(!failed && file && fgets(text_line, sizeof(text_line), file) && fgets(text_line, sizeof(text_line), file) &&
+          strlen(text_line) > strlen(wanted) && strcmp(text_line + strlen(text_line) - strlen(wanted), wanted) == 0,
+          "quality line '%s', expected it to end in '%s'", text_line, wanted);
+    if (file) {
+        fclose(file);
+    }
+    remove("test_counts_stream.csv");
+
+    for (int t = 0; t < STREAM_WORKERS; t++) {
+        stats_table_free(&data[t].table);
+    }
+    id_set_destroy(&seen_ids);
+    free(loader.records);
+    free(text);
+    device_dict_free(&dict);
+}
+
+int main(int argc, char **argv) {
+    if (!bind_kernels(NULL)) {
+        return 1;
+    }
+    long long rows = argc > 1 ? atoll(argv[1]) : DEFAULT_STREAM_ROWS;
+    test_aggregate_past_int_max();
+    test_merge_and_write();
+    test_stream(rows > 0 ? rows : DEFAULT_STREAM_ROWS);
+    printf("counts past 2^31: %s\n", failures == 0 ? "ok" : "FAILED");
+    return failures != 0;
+}
@@ -0,0 +1,131 @@
+// Duplicate ids are skipped once each, whether the ids are dense enough for
+// the bitmap or so sparse that the set falls back to a hash table. Built from
+// the analyzer source so the static functions are reachable:
+//
+//     gcc -O2 -o test_duplicates tests/test_duplicates.c -lpthread -lm && ./test_duplicates
+#include "../iot_analyzer.c"
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+#define NUM_IDS 1000
+
+// NUM_IDS distinct ids `stride` apart from `first`, every tenth sent twice,
+// plus readings without an id, which are never duplicates.
+static SensorRecord *make_records(long long first, long long stride, long long *count) {
+    SensorRecord *records = (SensorRecord *)calloc(NUM_IDS * 2, sizeof(SensorRecord));
+    long long n = 0;
+    for (int i = 0; i < NUM_IDS; i++) {
+        records[n].id = first + i * stride;
+        records[n++].seq = i;
+        if (i % 10 == 0) {
+            records[n].id = first + i * stride;
+            records[n++].seq = -1;  // marks the retransmitted copy
+        }
+        if (i % 100 == 0) {
+            records[n].id = -1;
+            records[n++].seq = i;
+        }
+    }
+    *count = n;
+    return records;
+}
+
+static void check_drop(const char *name, long long first, long long stride, int hashed) {
+    long long count;
+    SensorRecord *records = make_records(first, stride, &count);
+    long long min_id = first, max_id = first + (NUM_IDS - 1) * stride;
+    long long before = count;
+
+    IdSet probe;
+    CHECK(id_set_init(&probe, min_id, max_id, count), "%s: id_set_init failed", name);
+    CHECK((probe.slots != NULL) == hashed, "%s: expected a %s", name, hashed ? "hash table" : "bitmap");
+    id_set_destroy(&probe);
+
+    long long dropped = drop_duplicates(records, &count, min_id, max_id);
+    CHECK(dropped == NUM_IDS / 10, "%s: dropped %lld, expected %d", name, dropped, NUM_IDS / 10);
+    CHECK(count == before - NUM_IDS / 10, "%s: kept %lld records", name, count);
+    for (long long i = 0; i < count; i++) {
+        CHECK(records[i].seq >= 0, "%s: kept the retransmitted copy of id %lld", name, records[i].id);
+    }
+    free(records);
+}
+
+typedef struct {
+    IdSet *set;
+    int offset;
+    long long fresh;
+} InsertArgs;
+
+static void *insert_ids(void *arg) {
+    InsertArgs *args = (InsertArgs *)arg;
+    args->fresh = 0;
+    for (int i = 0; i < 100000; i++) {
+        long long id = ((i + args->offset) % 100000) * (1LL << 40);
+        args->fresh += id_set_insert(args->set, id);
+    }
+    return NULL;
+}
+
+// Several threads insert the same ids in different orders; each id must be
+// reported new exactly once in total.
+static void test_concurrent_hash(void) {
+    IdSet set;
+    pthread_t threads[4];
+    InsertArgs args[4];
+    CHECK(id_set_init(&set, 0, 99999 * (1LL << 40), 100000) && set.slots, "hash set not created");
+    for (int t = 0; t < 4; t++) {
+        args[t].set = &set;
+        args[t].offset = t * 25000;
+        pthread_create(&threads[t], NULL, insert_ids, &args[t]);
+    }
+    long long fresh = 0;
+    for (int t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+        fresh += args[t].fresh;
+    }
+    CHECK(fresh == 100000, "%lld ids reported new, expected 100000", fresh);
+    id_set_destroy(&set);
+}
+
+// The library skips a retransmitted id like the command line, also when the
+// copy arrives in a later batch, and keeps every reading without an id.
+static void test_library_ingest(void) {
+    IotAnalyzer *analyzer = iot_analyzer_create();
+    IotReading readings[4];
+    IotSensorStats stats[IOT_NUM_SENSORS];
+    memset(readings, 0, sizeof(readings));
+    for (int i = 0; i < 4; i++) {
+        readings[i].id = i < 2 ? 7 : -1;
+        readings[i].seq = -1;
+        readings[i].device = "dev_1";
+        readings[i].date = 20240105;
+        readings[i].values[0] = 20.0 + i;
+        readings[i].valid = 1;
+    }
+    CHECK(iot_ingest_batch(analyzer, readings, 4), "ingest failed");
+    CHECK(iot_ingest_batch(analyzer, readings, 1), "second ingest failed");
+    CHECK(iot_query(analyzer, "dev_1", 2024, 1, stats) && stats[0].count == 3,
+          "library kept %lld readings, expected 3", stats[0].count);
+    iot_analyzer_free(analyzer);
+    CHECK(iot_snapshot(NULL) == NULL, "iot_snapshot(NULL) returned a snapshot");
+}
+
+int main(void) {
+    check_drop("dense", 1000, 1, 0);
+    check_drop("sparse", 0, 1LL << 40, 1);
+    // Ids up to LLONG_MAX, where the span would overflow a signed subtraction.
+    check_drop("extreme", LLONG_MAX - (NUM_IDS - 1) * (LLONG_MAX / NUM_IDS), LLONG_MAX / NUM_IDS, 1);
+    test_concurrent_hash();
+    test_library_ingest();
+    printf("duplicate ids: %s\n", failures == 0 ? "ok" : "FAILED");
+    return failures != 0;
+}
@@ -0,0 +1,202 @@
+// The filter language: operator precedence and parentheses evaluate like
+// the equivalent C expression, malformed input is rejected, and selections
+// stay exact at the edges of a FILTER_BATCH batch. Built from the analyzer
+// source so the static functions are reachable:
+//
+//     gcc -O2 -o test_filter tests/test_filter.c -lpthread -lm && ./test_filter
+#include "../iot_analyzer.c"
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+#define NUM_RECORDS (3 * FILTER_BATCH + 7)
+
+static DeviceDict dict;
+static SensorRecord records[NUM_RECORDS];
+
+// Months 2024-01 to 2024-06, three devices, and a humidity that is missing
+// on every 13th record.
+static void make_records(void) {
+    device_dict_init(&dict);
+    device_dict_intern(&dict, "dev_1");
+    device_dict_intern(&dict, "dev_2");
+    device_dict_intern(&dict, "sirros_3");
+    for (int i = 0; i < NUM_RECORDS; i++) {
+        records[i].id = i;
+        records[i].device_id = i % 3;
+        records[i].date = 20240101 + (i % 6) * 100 + i % 28;
+        records[i].values[0] = i % 50;
+        records[i].values[1] = i % 97;
+        records[i].valid = i % 13 == 0 ? 1 : 3;
+    }
+}
+
+static int month(int i) {
+    return records[i].date / 100;
+}
+
+static int humidity_below(int i, double value) {
+    return (records[i].valid & 2) && records[i].values[1] < value;
+}
+
+static int expect_precedence(int i) {
+    return records[i].values[0] > 40 || (humidity_below(i, 10) && month(i) >= 202403);
+}
+
+static int expect_parenthesised(int i) {
+    return (records[i].values[0] > 40 || humidity_below(i, 10)) && month(i) >= 202403;
+}
+
+static int expect_not(int i) {
+    return !(records[i].values[0] > 40) && records[i].device_id == 0;
+}
+
+static int expect_nested(int i) {
+    return !(records[i].device_id == 2 || records[i].date < 20240215) &&
+           (records[i].valid & 2) && records[i].values[1] != 5;
+}
+
+// Runs `text` over every record a batch at a time and compares each
+// selection with `expected`.
+static void check_selects(const char *text, int (*expected)(int)) {
+    FilterProgram filter;
+    int selection[FILTER_BATCH];
+    int matches = 0;
+    if (!filter_compile(&filter, text) || !filter_prepare_devices(&filter, &dict)) {
+        CHECK(0, "'%s' did not compile", text);
+        return;
+    }
+    for (int i = 0; i < NUM_RECORDS; i += FILTER_BATCH) {
+        int n = NUM_RECORDS - i < FILTER_BATCH ? NUM_RECORDS - i : FILTER_BATCH;
+        int selected = filter_select(&filter, &records[i], n, selection);
+        int s = 0;
+        for (int j = 0; j < n; j++) {
+            int wanted = expected(i + j);
+            int got = s < selected && selection[s] == j;
+            s += got;
+            matches += wanted;
+            CHECK(got == wanted, "'%s' %s record %d", text, got ? "selected" : "missed", i + j);
+        }
+    }
+    CHECK(matches > 0 && matches < NUM_RECORDS, "'%s' matches %d of %d records, the case tests nothing",
+          text, matches, NUM_RECORDS);
+    filter_free(&filter);
+}
+
+static void test_precedence(void) {
+    check_selects("temperatura > 40 or umidade < 10 and date >= 2024-03", expect_precedence);
+    check_selects("temperatura > 40 || (umidade < 10 && date >= 2024-03)", expect_precedence);
+    check_selects("(temperatura > 40 or umidade < 10) and date >= 2024-03", expect_parenthesised);
+    check_selects("not temperatura > 40 and device = dev_1", expect_not);
+    check_selects("!(device ^= sirros or date < 2024-02-15) and umidade != 5", expect_nested);
+}
+
+static void test_malformed(void) {
+    static const char *bad[] = {
+        "(temperatura > 40",
+        "((temperatura > 40) or umidade < 10",
+        "temperatura > 40)",
+        "()",
+        "pressao > 3",
+        "temperaturas > 3",
+        "temperatura > 40 and",
+        "temperatura > 40 or",
+        "not",
+        "temperatura >",
+        "temperatura 40",
+        "temperatura > abc",
+        "date >= 2024-13",
+        "date >= 2024",
+        "device dev_1",
+        "device = \"dev_1",
+        "temperatura > 40 umidade < 10",
+    };
+    FilterProgram filter;
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        CHECK(!filter_compile(&filter, bad[i]), "'%s' compiled", bad[i]);
+        CHECK(filter.length == 0, "'%s' left %d instructions behind", bad[i], filter.length);
+    }
+    CHECK(filter_compile(&filter, "  ") && filter.length == 0, "a blank filter is not empty");
+}
+
+// filter_select on batches of 0, 1, FILTER_BATCH - 1 and FILTER_BATCH
+// records whose first and last record match.
+static void test_batch_edges(void) {
+    static const int sizes[] = {0, 1, 2, FILTER_BATCH - 1, FILTER_BATCH};
+    SensorRecord batch[FILTER_BATCH];
+    int selection[FILTER_BATCH];
+    FilterProgram filter;
+    filter_compile(&filter, "temperatura >= 99");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        memset(batch, 0, sizeof(batch));
+        for (int j = 0; j < FILTER_BATCH; j++) {
+            batch[j].valid = 1;
+            batch[j].values[0] = j == 0 || j == n - 1 || j >= n ? 99 : 0;
+        }
+        int selected = filter_select(&filter, batch, n, selection);
+        int wanted = n == 0 ? 0 : n == 1 ? 1 : 2;
+        CHECK(selected == wanted, "batch of %d selected %d, expected %d", n, selected, wanted);
+        CHECK(selected == 0 || (selection[0] == 0 && selection[selected - 1] == n - 1),
+              "batch of %d selected the wrong records", n);
+    }
+    filter_free(&filter);
+}
+
+// scan_records aggregates the matches in place, a stretch of consecutive
+// matches at a time; stretches that end at, start at or straddle a batch
+// boundary must each be counted once.
+static void test_scan_edges(void) {
+    static const int matching[] = {
+        0, FILTER_BATCH - 1, FILTER_BATCH, 2 * FILTER_BATCH - 2, 2 * FILTER_BATCH - 1,
+        2 * FILTER_BATCH, 2 * FILTER_BATCH + 1, NUM_RECORDS - 1
+    };
+    int num_matching = sizeof(matching) / sizeof(matching[0]);
+    SensorRecord *scan = (SensorRecord *)malloc(NUM_RECORDS * sizeof(SensorRecord));
+    memcpy(scan, records, NUM_RECORDS * sizeof(SensorRecord));
+    for (int i = 0; i < NUM_RECORDS; i++) {
+        scan[i].device_id = 0;
+        scan[i].date = 20240110;
+        scan[i].values[0] = 0;
+    }
+    for (int m = 0; m < num_matching; m++) {
+        scan[matching[m]].values[0] = 99;
+    }
+
+    GroupSpec spec;
+    FilterProgram filter;
+    StatsTable result;
+    long long matched;
+    memset(&spec, 0, sizeof(spec));
+    parse_group_by_option("device,month", &spec);
+    filter_compile(&filter, "temperatura >= 99");
+    CHECK(scan_records(scan, NUM_RECORDS, &filter, &spec, &result, &matched), "scan failed");
+    CHECK(matched == num_matching, "scan matched %lld records, expected %d", matched, num_matching);
+    CHECK(result.count == 1 && result.entries[0].rows == num_matching && result.entries[0].count[0] == num_matching,
+          "scan aggregated %lld rows, expected %d", result.count == 1 ? result.entries[0].rows : -1LL, num_matching);
+    stats_table_free(&result);
+    filter_free(&filter);
+    free(scan);
+}
+
+int main(void) {
+    if (!bind_kernels(NULL)) {
+        return 1;
+    }
+    make_records();
+    test_precedence();
+    test_malformed();
+    test_batch_edges();
+    test_scan_edges();
+    device_dict_free(&dict);
+    printf("filter: %s\n", failures == 0 ? "ok" : "FAILED");
+    return failures != 0;
+}
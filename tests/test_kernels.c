@@ -0,0 +1,193 @@
+// Checks every kernel variant the CPU supports against the scalar one on the
+// same inputs. Built from the analyzer source so the static kernels are
+// reachable:
+//
+//     gcc -O2 -o test_kernels tests/test_kernels.c -lpthread -lm && ./test_kernels
+#include "../iot_analyzer.c"
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ULL;
+
+static unsigned int test_random(void) {
+    rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)(rng_state >> 33);
+}
+
+// Doubles compare equal when both are NaN or bitwise the same value.
+static int same_double(double a, double b) {
+    return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static int same_stats(const MonthlyStats *a, const MonthlyStats *b) {
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        if (!same_double(a->max[i], b->max[i]) || !same_double(a->min[i], b->min[i]) ||
+            !same_double(a->sum[i], b->sum[i]) ||
+            a->count[i] != b->count[i] || a->out_of_range[i] != b->out_of_range[i]) {
+            return 0;
+        }
+    }
+    return a->rows == b->rows;
+}
+
+// Random readings with missing sensors, NaN, infinities and values on and
+// outside the valid range bounds.
+static void make_record(SensorRecord *record) {
+    memset(record, 0, sizeof(*record));
+    record->id = test_random();
+    record->seq = test_random() % 1000;
+    record->date = 20240101;
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        switch (test_random() % 8) {
+        case 0:
+            record->values[i] = NAN;
+            break;
+        case 1:
+            record->values[i] = test_random() % 2 ? INFINITY : -INFINITY;
+            break;
+        case 2:
+            record->values[i] = test_random() % 2 ? sensor_min_valid[i] : sensor_max_valid[i];
+            break;
+        default:
+            record->values[i] = (double)(test_random() % 200000) / 10.0 - 5000.0;
+            break;
+        }
+        if (test_random() % 4 != 0) {
+            record->valid |= 1u << i;
+        }
+    }
+}
+
+static void test_update_stats(const KernelSet *scalar, const KernelSet *set) {
+    for (int round = 0; round < 200; round++) {
+        MonthlyStats expected, actual;
+        GroupKey key = {0, 0};
+        initialize_stats(&expected, key);
+        initialize_stats(&actual, key);
+        for (int n = 0; n < 50; n++) {
+            SensorRecord record;
+            make_record(&record);
+            scalar->update_stats(&expected, &record);
+            set->update_stats(&actual, &record);
+        }
+        CHECK(same_stats(&expected, &actual), "%s update_stats differs from scalar (round %d)", set->name, round);
+    }
+}
+
+// Runs of every length up to a few vector widths, so each ragged tail is
+// exercised. Records sit at the end of their buffer so over-reads show up
+// under AddressSanitizer.
+static void test_update_run(const KernelSet *scalar, const KernelSet *set) {
+    for (int count = 1; count <= 40; count++) {
+        SensorRecord *records = (SensorRecord *)malloc(count * sizeof(SensorRecord));
+        for (int i = 0; i < count; i++) {
+            make_record(&records[i]);
+        }
+        MonthlyStats expected, actual;
+        GroupKey key = {0, 0};
+        initialize_stats(&expected, key);
+        initialize_stats(&actual, key);
+        scalar->update_run(&expected, records, count);
+        set->update_run(&actual, records, count);
+        CHECK(same_stats(&expected, &actual), "%s update_run differs from scalar for %d records", set->name, count);
+        free(records);
+    }
+}
+
+static void check_scan(const KernelSet *scalar, const KernelSet *set, const char *text, size_t length) {
+    // An exact-size copy, so reading past `end` is caught by AddressSanitizer.
+    char *line = (char *)malloc(length ? length : 1);
+    memcpy(line, text, length);
+    LineScan expected, actual;
+    scalar->scan_line(line, line + length, &expected);
+    set->scan_line(line, line + length, &actual);
+
+    int same = expected.end == actual.end && expected.num_seps == actual.num_seps &&
+               expected.has_nul == actual.has_nul;
+    for (int i = 0; same && i < expected.num_seps; i++) {
+        same = expected.seps[i] == actual.seps[i];
+    }
+    CHECK(same, "%s scan_line differs from scalar on a %zu-byte line", set->name, length);
+    free(line);
+}
+
+static void test_scan_line(const KernelSet *scalar, const KernelSet *set) {
+    static const char *lines[] = {
+        "",
+        "\n",
+        "1|2024-01-01 10:00:00.000|dev_1|5|21.5|55.0|300.0|40.0|500|10|-29.1|-51.2\n",
+        "1|2024-01-01 10:00:00.000|dev_1|5|21.5|55.0|300.0|40.0|500|10|-29.1|-51.2",
+        "1|2024-01-01|dev_1||||||||||||||||||||||||||||||||||\n",
+        "1|2024-01-01|dev_1\n2|2024-01-02|dev_2|3|4|5|6|7|8|9|10|11\n",
+        "only one field with no separators at all, longer than any vector width",
+    };
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        check_scan(scalar, set, lines[i], strlen(lines[i]));
+    }
+
+    // Every length from 0 to 200 bytes, with separators, newlines and NUL
+    // bytes placed at random.
+    char text[200];
+    for (int length = 0; length <= (int)sizeof(text); length++) {
+        for (int round = 0; round < 20; round++) {
+            for (int i = 0; i < length; i++) {
+                unsigned int r = test_random() % 40;
+                text[i] = r < 6 ? '|' : r == 6 ? '\n' : r == 7 ? '\0' : (char)('a' + r % 26);
+            }
+            check_scan(scalar, set, text, (size_t)length);
+        }
+    }
+}
+
+static void test_parse_value(const KernelSet *scalar, const KernelSet *set) {
+    static const char *tokens[] = {
+        "", "21.5", "-0", "0.000001", "1e3", "-1.5E-2", "nan", "NaN", "inf", "-inf",
+        "abc", "12abc", " 7", "7 ", "1.7976931348623157e308", "1e400", ".", "-", "+3",
+    };
+    for (size_t i = 0; i < sizeof(tokens) / sizeof(tokens[0]); i++) {
+        size_t length = strlen(tokens[i]);
+        char *token = (char *)malloc(length ? length : 1);
+        memcpy(token, tokens[i], length);
+        double expected = 0.0, actual = 0.0;
+        int expected_ok = scalar->parse_value(token, token + length, &expected);
+        int actual_ok = set->parse_value(token, token + length, &actual);
+        CHECK(expected_ok == actual_ok && (!expected_ok || same_double(expected, actual)),
+              "%s parse_value differs from scalar on '%s'", set->name, tokens[i]);
+        free(token);
+    }
+}
+
+int main(void) {
+    KernelSet scalar;
+    if (!select_kernels("scalar", &scalar)) {
+        return 1;
+    }
+    int count = (int)(sizeof(kernel_variants) / sizeof(kernel_variants[0]));
+    for (int i = 0; i < count; i++) {
+        KernelSet set;
+        if (!cpu_supports(kernel_variants[i].isa)) {
+            printf("%s: not supported by this CPU, skipped\n", kernel_variants[i].set.name);
+            continue;
+        }
+        if (!select_kernels(kernel_variants[i].set.name, &set)) {
+            failures++;
+            continue;
+        }
+        int before = failures;
+        test_scan_line(&scalar, &set);
+        test_parse_value(&scalar, &set);
+        test_update_stats(&scalar, &set);
+        test_update_run(&scalar, &set);
+        printf("%s: %s\n", set.name, failures == before ? "ok" : "FAILED");
+    }
+    return failures != 0;
+}
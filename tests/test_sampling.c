@@ -0,0 +1,128 @@
+// Approximate mode: a sampled mean's interval comes from the spread between
+// the sampled blocks, whatever order the records are in, and a sensor read
+// in a single block gets no interval. Built from the analyzer source so the
+// static functions are reachable:
+//
+//     gcc -O2 -o test_sampling tests/test_sampling.c -lpthread -lm && ./test_sampling
+#include "../iot_analyzer.c"
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+#define NUM_BLOCKS 4
+#define PER_BLOCK 3
+
+static const double block_levels[NUM_BLOCKS] = {18.0, 21.5, 19.0, 25.0};
+
+// dev_0 reads temperature in every block, around a level of its own, and
+// humidity only in block 1; dev_1 appears in block 2 alone. Out-of-range and
+// undated readings ride along and must be left out. The blocks come in
+// reverse order and the devices interleaved, as after sorting.
+static int make_records(SensorRecord *records) {
+    int n = 0;
+    for (int b = NUM_BLOCKS - 1; b >= 0; b--) {
+        for (int k = 0; k < PER_BLOCK; k++) {
+            SensorRecord *record = &records[n++];
+            memset(record, 0, sizeof(*record));
+            record->device_id = 0;
+            record->date = 20240310;
+            record->block = b;
+            record->values[0] = block_levels[b] + (k - 1);
+            record->values[1] = 40.0 + k;
+            record->valid = b == 1 ? 3 : 1;
+            if (b == 2) {
+                record = &records[n++];
+                memset(record, 0, sizeof(*record));
+                record->device_id = 1;
+                record->date = 20240310;
+                record->block = b;
+                record->values[0] = 30.0 + k;
+                record->valid = 1;
+            }
+        }
+        SensorRecord *stray = &records[n++];
+        memset(stray, 0, sizeof(*stray));
+        stray->device_id = 0;
+        stray->date = b % 2 ? 0 : 20240310;
+        stray->block = b;
+        stray->values[0] = b % 2 ? 22.0 : 1e9;
+        stray->valid = 1;
+    }
+    return n;
+}
+
+int main(void) {
+    if (!iot_set_valid_range("temperatura=-50:100") || !bind_kernels(NULL)) {
+        return 1;
+    }
+    SensorRecord records[NUM_BLOCKS * (2 * PER_BLOCK + 1)];
+    int count = make_records(records);
+
+    GroupSpec spec;
+    StatsTable table;
+    memset(&spec, 0, sizeof(spec));
+    parse_group_by_option("device,month", &spec);
+    stats_table_init(&table);
+    for (int i = 0; i < count; i++) {
+        if (records[i].date != 0) {
+            int e = stats_table_find_or_add(&table, group_key(&spec, &records[i]));
+            process_record_scalar(&table.entries[e], &records[i]);
+        }
+    }
+
+    // dev_0's temperature by hand: each block's readings sum to PER_BLOCK
+    // times its level, so the block sums of deviations are
+    // PER_BLOCK * (level - mean).
+    double mean = 0.0, squares = 0.0, f = 0.25;
+    int n = NUM_BLOCKS * PER_BLOCK;
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        mean += block_levels[b] / NUM_BLOCKS;
+    }
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        double sum = PER_BLOCK * (block_levels[b] - mean);
+        squares += sum * sum;
+    }
+    double expected = t_quantiles[NUM_BLOCKS - 1] *
+                      sqrt((1.0 - f) * NUM_BLOCKS / (NUM_BLOCKS - 1) * squares / ((double)n * n));
+
+    BlockSample sample = {records, count, NUM_BLOCKS, f};
+    double *intervals = block_intervals(&table, &spec, spec.parts, &sample);
+    CHECK(intervals != NULL, "block_intervals failed");
+    for (int e = 0; intervals && e < table.count; e++) {
+        const MonthlyStats *stats = &table.entries[e];
+        const double *interval = &intervals[(size_t)e * NUM_SENSORS];
+        if ((stats->key.lo & 0xFFFFFFFFu) == 0) {
+            CHECK(stats->count[0] == n, "dev_0 kept %lld temperatures, expected %d", stats->count[0], n);
+            CHECK(fabs(interval[0] - expected) <= 1e-9 * expected, "dev_0 temperature interval %g, expected %g",
+                  interval[0], expected);
+            CHECK(interval[1] == -1.0, "humidity from one block got an interval of %g", interval[1]);
+        } else {
+            CHECK(interval[0] == -1.0, "dev_1 from one block got an interval of %g", interval[0]);
+        }
+    }
+    CHECK(table.count == 2, "%lld groups, expected 2", table.count);
+
+    // A single sampled block measures no spread at all.
+    sample.num_blocks = 1;
+    for (int i = 0; i < count; i++) {
+        records[i].block = 0;
+    }
+    free(intervals);
+    intervals = block_intervals(&table, &spec, spec.parts, &sample);
+    for (int e = 0; intervals && e < table.count; e++) {
+        CHECK(intervals[(size_t)e * NUM_SENSORS] == -1.0, "one block gave an interval of %g",
+              intervals[(size_t)e * NUM_SENSORS]);
+    }
+    free(intervals);
+    stats_table_free(&table);
+    printf("sampling: %s\n", failures == 0 ? "ok" : "FAILED");
+    return failures != 0;
+}